@@ -23,8 +23,10 @@
 #include <time.h>
 #include <assert.h>
 #include <math.h>
+#include <sys/mman.h>
 #include "fcyc.h"
 #include "defs.h"
+#include "kernels.h"
 
 //sharpen kernel
 Kernel sharpen_kernel = 
@@ -131,8 +133,10 @@ extern const team_t team;
 
 /* Misc constants */
 #define BSIZE 32     /* cache block size in bytes */     
-#define MAX_DIM 2560 /* 1024 + 256 */
+#define HUGE_PAGE (2UL << 20) /* image buffers ask for 2 MB pages */
 #define ODD_DIM 96   /* not a power of 2 */
+#define ODD_HEIGHT 61 /* rectangular check image is ODD_DIM x ODD_HEIGHT */
+#define RECT_PAD 8   /* extra pixels per row, so rect strides != widths */
 
 /* fast versions of min and max */
 #define min(a,b) (a < b ? a : b)
@@ -141,6 +145,8 @@ extern const team_t team;
 /* This struct characterizes the results for one benchmark test */
 typedef struct {
     lab_test_func tfunct; /* The test function */
+    lab_inplace_func ifunct; /* In-place flip, run instead of tfunct if set */
+    lab_rect_func rfunct; /* Rectangular version, run on test_dim_rect if set */
     double cpes[DIM_CNT]; /* One CPE result for each dimension */
     char *description;    /* ASCII description of the test function */
     unsigned short valid; /* The function is tested if this is non zero */
@@ -151,6 +157,9 @@ static int test_dim_flip[] = {256, 512, 1024, 2048};
 static int test_dim_convolve[] = {256, 512, 1024, 2048};
 //static int test_dim_normalization[] = {256, 512, 1024, 2048};
 
+/* Rectangular benchmarks use 16:9 frames, {width, height} */
+static int test_dim_rect[DIM_CNT][2] = {{640, 360}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+
 /* Baseline CPEs (see config.h) */
 static double flip_baseline_cpes[4];
 static double convolve_baseline_cpes[4];
@@ -168,10 +177,11 @@ static int convolve_benchmark_count = 0;
 /* 
  * An image is a dimxdim matrix of pixels stored in a 1D array.  The
  * data array holds three images (the input original, a copy of the original, 
- * and the output result array. There is also an additional BSIZE bytes
- * of padding for alignment to cache block boundaries.
+ * and the output result array. It is mapped at startup, sized for the
+ * largest benchmark, on 2 MB pages where the system allows it (see
+ * alloc_images()).
  */
-static pixel data[(3*MAX_DIM*MAX_DIM) + (BSIZE/sizeof(pixel))];
+static pixel *data = NULL;
 
 /* Various image pointers */
 static pixel *orig = NULL;         /* original image */
@@ -190,6 +200,7 @@ char *convolve_maxmean_desc = NULL;
 void add_convolve_function(lab_test_func f, char *description) 
 {
     benchmarks_convolve[convolve_benchmark_count].tfunct = f;
+    benchmarks_convolve[convolve_benchmark_count].rfunct = NULL;
     benchmarks_convolve[convolve_benchmark_count].description = description;
     benchmarks_convolve[convolve_benchmark_count].valid = 0;  
     convolve_benchmark_count++;
@@ -199,12 +210,46 @@ void add_convolve_function(lab_test_func f, char *description)
 void add_flip_function(lab_test_func f, char *description) 
 {
     benchmarks_flip[flip_benchmark_count].tfunct = f;
+    benchmarks_flip[flip_benchmark_count].ifunct = NULL;
+    benchmarks_flip[flip_benchmark_count].rfunct = NULL;
+    benchmarks_flip[flip_benchmark_count].description = description;
+    benchmarks_flip[flip_benchmark_count].valid = 0;
+    flip_benchmark_count++;
+}
+
+
+void add_inplace_flip_function(lab_inplace_func f, char *description) 
+{
+    benchmarks_flip[flip_benchmark_count].tfunct = NULL;
+    benchmarks_flip[flip_benchmark_count].ifunct = f;
+    benchmarks_flip[flip_benchmark_count].rfunct = NULL;
     benchmarks_flip[flip_benchmark_count].description = description;
     benchmarks_flip[flip_benchmark_count].valid = 0;
     flip_benchmark_count++;
 }
 
 
+void add_rect_flip_function(lab_rect_func f, char *description) 
+{
+    benchmarks_flip[flip_benchmark_count].tfunct = NULL;
+    benchmarks_flip[flip_benchmark_count].ifunct = NULL;
+    benchmarks_flip[flip_benchmark_count].rfunct = f;
+    benchmarks_flip[flip_benchmark_count].description = description;
+    benchmarks_flip[flip_benchmark_count].valid = 0;
+    flip_benchmark_count++;
+}
+
+
+void add_rect_convolve_function(lab_rect_func f, char *description) 
+{
+    benchmarks_convolve[convolve_benchmark_count].tfunct = NULL;
+    benchmarks_convolve[convolve_benchmark_count].rfunct = f;
+    benchmarks_convolve[convolve_benchmark_count].description = description;
+    benchmarks_convolve[convolve_benchmark_count].valid = 0;  
+    convolve_benchmark_count++;
+}
+
+
 //void add_normalization_function(lab_test_func f, char *description) 
 //{
 //    benchmarks_normalization[normalization_benchmark_count].tfunct = f;
@@ -263,8 +308,24 @@ void copy_flip_baselines(const double* baselines){
     flip_baseline_cpes[3] = baselines[3];
 }
 
+/* Which of the seven mappings ridx_f_factory() picked */
+static int flip_kind = -1;
+
+/* The same seven mappings as transforms, for rectangular images */
+static const flip_transform flip_kind_transform[7] = {
+    FLIP_MIRROR_VERTICAL, FLIP_MIRROR_HORIZONTAL, FLIP_MIRROR_BOTH,
+    FLIP_ROTATE_CW, FLIP_ROTATE_ACW, FLIP_TRANSPOSE, FLIP_REFLECT_BOTH
+};
+
+/* And as index functions, for checks that try every mapping */
+static const FlippedFunc flip_kind_func[7] = {
+    mirror_vertical_func, mirror_horizontal_func, mirror_both_func,
+    rotate_clockwise_func, rotate_anticlockwise_func, transpose_func, reflect_both_func
+};
+
 FlippedFunc ridx_f_factory(){
-    switch(((team_hash>>16)&0xFFFF)%7){
+    flip_kind = ((team_hash>>16)&0xFFFF)%7;
+    switch(flip_kind){
         case 0:
             copy_flip_baselines(mirror_vertical_baselines);
             return &mirror_vertical_func;
@@ -380,19 +441,19 @@ static int compare_pixels(pixel p1, pixel p2)
 }
 
 
-/* Make sure the orig array is unchanged */
-static int check_orig(int dim) 
+/* Make sure the orig array (height rows, stride apart) is unchanged */
+static int check_orig_rect(int width, int height, int stride) 
 {
     int i, j;
 
-    for (i = 0; i < dim; i++) 
-    for (j = 0; j < dim; j++) 
-        if (compare_pixels(orig[RIDX(i,j,dim)], copy_of_orig[RIDX(i,j,dim)])) {
+    for (i = 0; i < height; i++) 
+    for (j = 0; j < width; j++) 
+        if (compare_pixels(orig[RIDX(i,j,stride)], copy_of_orig[RIDX(i,j,stride)])) {
         printf("\n");
         printf("Error: Original image has been changed! \n");
         printf("e.g., the following two pixels should have equal value:\n");
-        pixel orig_bad = orig[RIDX(i,j,dim)];
-        pixel copy_bad = copy_of_orig[RIDX(i,j,dim)];
+        pixel orig_bad = orig[RIDX(i,j,stride)];
+        pixel copy_bad = copy_of_orig[RIDX(i,j,stride)];
         printf("orig[%d][%d].{red,green,blue} =! orig_copy[%d][%d]\n {%d, %d, %d} != {%d, %d, %d}\n", i, j, i, j, orig_bad.red, orig_bad.green, orig_bad.blue, copy_bad.red, copy_bad.green, copy_bad.blue);
         return 1;
         }
@@ -400,6 +461,11 @@ static int check_orig(int dim)
     return 0;
 }
 
+static int check_orig(int dim) 
+{
+    return check_orig_rect(dim, dim, dim);
+}
+
 /* 
  * random_in_interval - Returns random integer in interval [low, high) 
  */
@@ -410,9 +476,109 @@ static int random_in_interval(int low, int high)
 }
 
 /*
- * create - creates a dimxdim image aligned to a BSIZE byte boundary
+ * images_needed - Pixels the three images take at the largest square
+ *     and rectangular benchmark sizes
  */
-static void create(int dim)
+static size_t images_needed(void)
+{
+    size_t need = 3UL*ODD_DIM*ODD_DIM;
+    size_t n;
+    int i, w, h;
+
+    for (i = 0; i < DIM_CNT; i++) {
+	n = 3UL*test_dim_flip[i]*test_dim_flip[i];
+	need = max(need, n);
+	n = 3UL*test_dim_convolve[i]*test_dim_convolve[i];
+	need = max(need, n);
+	/* src and its copy plus a dst that may be transposed, all padded */
+	w = test_dim_rect[i][0];
+	h = test_dim_rect[i][1];
+	n = 2UL*h*(w + RECT_PAD) + max((size_t)h*(w + RECT_PAD), (size_t)w*(h + RECT_PAD));
+	need = max(need, n);
+    }
+    return need;
+}
+
+/*
+ * huge_pages_used - Returns 1 if the transparent huge page code backed
+ *     any of [p, p+len) with 2 MB pages, going by /proc/self/smaps
+ */
+static int huge_pages_used(void *p, size_t len)
+{
+    unsigned long start, end, kb;
+    int inside = 0, used = 0;
+    char line[256];
+    FILE *fp = fopen("/proc/self/smaps", "r");
+
+    if (fp == NULL)
+	return 0;
+    while (fgets(line, sizeof(line), fp)) {
+	if (sscanf(line, "%lx-%lx", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' '))
+	    inside = start < (unsigned long)p + len && end > (unsigned long)p;
+	else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 && kb > 0)
+	    used = 1;
+    }
+    fclose(fp);
+    return used;
+}
+
+/*
+ * alloc_images - Maps a buffer big enough for pixels pixels. Explicit
+ *     huge pages (MAP_HUGETLB) are tried first, then a 2 MB aligned
+ *     mapping with madvise(MADV_HUGEPAGE), which falls back to 4 KB
+ *     pages if the kernel has none to give. The buffer is touched
+ *     once so its pages exist before anything is timed, and the page
+ *     size it got is reported.
+ */
+static void alloc_images(size_t pixels)
+{
+    size_t bytes = (pixels*sizeof(pixel) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    const char *kind;
+    char *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+	kind = "2 MB pages (hugetlbfs)";
+#endif
+    if (p == MAP_FAILED) {
+	/* over-map by a huge page so the buffer can start on a 2 MB boundary */
+	char *raw = mmap(NULL, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+	    fprintf(stderr, "Can't map %lu MB for the images\n", (unsigned long)(bytes >> 20));
+	    exit(EXIT_FAILURE);
+	}
+	p = (char *)(((unsigned long)raw + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+	if (p > raw)
+	    munmap(raw, p - raw);
+	munmap(p + bytes, raw + HUGE_PAGE - p);
+#ifdef MADV_HUGEPAGE
+	madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+	memset(p, 0, bytes);
+	if (huge_pages_used(p, bytes))
+	    kind = "2 MB pages (transparent)";
+	else {
+	    static char base[32];
+	    sprintf(base, "%ld KB pages", sysconf(_SC_PAGESIZE) >> 10);
+	    kind = base;
+	}
+    }
+    else
+	memset(p, 0, bytes);
+
+    data = (pixel *)p;
+    printf("Image buffers: %lu MB on %s\n", (unsigned long)(bytes >> 20), kind);
+}
+
+/*
+ * create_rect - creates a height x stride image (width pixels used per
+ *     row) and a result_size pixel result, aligned to a BSIZE byte
+ *     boundary
+ */
+static void create_rect(int width, int height, int stride, int result_size)
 {
     int i, j;
 
@@ -420,43 +586,70 @@ static void create(int dim)
     orig = data;
     while ((unsigned long)orig % BSIZE)
 		orig = (pixel*)(((char*)orig)+1);
-    result = orig + dim*dim;
-    copy_of_orig = result + dim*dim;
+    result = orig + height*stride;
+    copy_of_orig = result + result_size;
 
-    for (i = 0; i < dim; i++) {
-	for (j = 0; j < dim; j++) {
+    for (i = 0; i < height; i++) {
+	for (j = 0; j < stride; j++) {
 	    /* Original image initialized to random colors */
-	    orig[RIDX(i,j,dim)].red = random_in_interval(0, 65536);
-	    orig[RIDX(i,j,dim)].green = random_in_interval(0, 65536);
-	    orig[RIDX(i,j,dim)].blue = random_in_interval(0, 65536);
+	    orig[RIDX(i,j,stride)].red = random_in_interval(0, 65536);
+	    orig[RIDX(i,j,stride)].green = random_in_interval(0, 65536);
+	    orig[RIDX(i,j,stride)].blue = random_in_interval(0, 65536);
 
 	    /* Copy of original image for checking result */
-	    copy_of_orig[RIDX(i,j,dim)].red = orig[RIDX(i,j,dim)].red;
-	    copy_of_orig[RIDX(i,j,dim)].green = orig[RIDX(i,j,dim)].green;
-	    copy_of_orig[RIDX(i,j,dim)].blue = orig[RIDX(i,j,dim)].blue;
-
-	    /* Result image initialized to all black */
-	    result[RIDX(i,j,dim)].red = 0;
-	    result[RIDX(i,j,dim)].green = 0;
-	    result[RIDX(i,j,dim)].blue = 0;
+	    copy_of_orig[RIDX(i,j,stride)] = orig[RIDX(i,j,stride)];
 	}
     }
 
+    /* Result image initialized to all black */
+    for (i = 0; i < result_size; i++) {
+	result[i].red = 0;
+	result[i].green = 0;
+	result[i].blue = 0;
+    }
+
     return;
 }
 
+/*
+ * create - creates a dimxdim image aligned to a BSIZE byte boundary
+ */
+static void create(int dim)
+{
+    create_rect(dim, dim, dim, dim*dim);
+}
+
+
 
 
+/*
+ * CHECK_FLIP_LOOP - Compares result against orig with the mapping's
+ *     index expression written inline (no call per pixel)
+ */
+#define CHECK_FLIP_LOOP(MAP)                                            \
+    for (i = 0; i < dim; i++) {                                         \
+        for (j = 0; j < dim; j++) {                                     \
+            const pixel *a = &orig[RIDX(i,j,dim)], *b = &result[MAP];   \
+            if (a->red != b->red || a->green != b->green ||             \
+                a->blue != b->blue) {                                   \
+                err++;                                                  \
+                badi = i;                                               \
+                badj = j;                                               \
+            }                                                           \
+        }                                                               \
+    }
 
 /* 
  * check_flip - Make sure the flip actually works. 
  * The orig array should not  have been tampered with! 
+ * In inplace mode result started out as a copy of orig and was
+ * flipped where it stood.
  */
-static int check_flip(int dim) 
+static int check_flip(int dim, int inplace) 
 {
     int err = 0;
     int i, j;
-    int badi, badj;
+    int badi = 0, badj = 0;
     pixel orig_bad = {0,0,0};
 	pixel res_bad = {0,0,0};
 
@@ -464,16 +657,19 @@ static int check_flip(int dim)
     if (check_orig(dim)) 
 	return 1; 
 
-    for (i = 0; i < dim; i++){
-	    for (j = 0; j < dim; j++) 
-	        if (compare_pixels(orig[RIDX(i,j,dim)], 
-		    	       result[RIDX_F(i,j,dim)])) {
-		    err++;
-		    badi = i;
-		    badj = j;
-		    orig_bad = orig[RIDX(i,j,dim)];
-		    res_bad = result[RIDX_F(i,j,dim)];
-	    }
+    switch (flip_kind) {
+    case 0: CHECK_FLIP_LOOP(RIDX(i, dim-1-j, dim)); break;
+    case 1: CHECK_FLIP_LOOP(RIDX(dim-1-i, j, dim)); break;
+    case 2: CHECK_FLIP_LOOP(RIDX(dim-1-i, dim-1-j, dim)); break;
+    case 3: CHECK_FLIP_LOOP(RIDX(j, dim-1-i, dim)); break;
+    case 4: CHECK_FLIP_LOOP(RIDX(dim-1-j, i, dim)); break;
+    case 5: CHECK_FLIP_LOOP(RIDX(j, i, dim)); break;
+    case 6: CHECK_FLIP_LOOP(RIDX(dim-1-j, dim-1-i, dim)); break;
+    default: CHECK_FLIP_LOOP(RIDX_F(i, j, dim)); break;
+    }
+    if (err) {
+	orig_bad = orig[RIDX(badi,badj,dim)];
+	res_bad = result[RIDX_F(badi,badj,dim)];
     }
     if (err) {
 	printf("\n");
@@ -481,14 +677,14 @@ static int check_flip(int dim)
 	printf("E.g., The following two pixels should have equal value:\n");
 	printf("src[%d].{red,green,blue} = {%d,%d,%d}\n",
 	       RIDX(badi,badj,dim), orig_bad.red, orig_bad.green, orig_bad.blue);
-	printf("dst[%d].{red,green,blue} = {%d,%d,%d}\n",
+	printf("%s[%d].{red,green,blue} = {%d,%d,%d}\n", inplace ? "img" : "dst",
 	       RIDX_F(badi,badj,dim), res_bad.red, res_bad.green, res_bad.blue);
     }
 
     return err;
 }
 
-static pixel check_convolution(int dim, int i, int j, pixel *src) {
+static pixel check_convolution(int width, int height, int stride, int i, int j, pixel *src) {
     pixel result;
     int ii, jj;
     float sum0, sum1, sum2, weight;
@@ -498,14 +694,14 @@ static pixel check_convolution(int dim, int i, int j, pixel *src) {
     sum0 = sum1 = sum2 = weight = 0;
     for(ii=i-2; ii <= i+2; ii++) {
 	for(jj=j-2; jj <= j+2; jj++) {
-        if(ii < 0 || ii >= dim || jj < 0 || jj >= dim){
+        if(ii < 0 || ii >= height || jj < 0 || jj >= width){
             continue;
         }
         kernelI = (ii - i)+2;
         kernelJ = (jj - j)+2;
-	    sum0 += src[RIDX(ii,jj,dim)].red * kernel[kernelI][kernelJ];
-	    sum1 += src[RIDX(ii,jj,dim)].green * kernel[kernelI][kernelJ];
-	    sum2 += src[RIDX(ii,jj,dim)].blue * kernel[kernelI][kernelJ];
+	    sum0 += src[RIDX(ii,jj,stride)].red * kernel[kernelI][kernelJ];
+	    sum1 += src[RIDX(ii,jj,stride)].green * kernel[kernelI][kernelJ];
+	    sum2 += src[RIDX(ii,jj,stride)].blue * kernel[kernelI][kernelJ];
         weight += kernel[kernelI][kernelJ];
 	}
     }
@@ -517,10 +713,11 @@ static pixel check_convolution(int dim, int i, int j, pixel *src) {
 }
 
 /* 
- * check_convolve - Make sure the convolve function actually works.  The
- * orig array should not have been tampered with!  
+ * check_convolve_rect - Make sure the convolve function actually works
+ * on a width x height image (src rows src_stride apart, dst rows
+ * dst_stride apart).  The orig array should not have been tampered with!  
  */
-static int check_convolve(int dim) {
+static int check_convolve_rect(int width, int height, int src_stride, int dst_stride) {
     int err = 0;
     int i, j;
     int badi = 0;
@@ -529,7 +726,7 @@ static int check_convolve(int dim) {
     pixel wrong = {0,0,0};
 
     /* return 1 if original image has been changed */
-    if (check_orig(dim)){
+    if (check_orig_rect(width, height, src_stride)){
     	return 1; 
     }
 
@@ -547,14 +744,14 @@ static int check_convolve(int dim) {
         }
     }
 
-    for (i = 0; i < dim; i++) {
-    	for (j = 0; j < dim; j++) {
-    	    pixel convolved = check_convolution(dim, i, j, orig);
-    	    if (compare_pixels(result[RIDX(i,j,dim)], convolved)) {
+    for (i = 0; i < height; i++) {
+    	for (j = 0; j < width; j++) {
+    	    pixel convolved = check_convolution(width, height, src_stride, i, j, orig);
+    	    if (compare_pixels(result[RIDX(i,j,dst_stride)], convolved)) {
     		err++;
     		badi = i;
     		badj = j;
-    		wrong = result[RIDX(i,j,dim)];
+    		wrong = result[RIDX(i,j,dst_stride)];
     		right = convolved;
     	    }
     	}
@@ -562,7 +759,10 @@ static int check_convolve(int dim) {
 
     if (err) {
 	printf("\n");
-	printf("ERROR: Dimension=%d, %d errors\n", dim, err);    
+	if (width == height)
+	    printf("ERROR: Dimension=%d, %d errors\n", width, err);    
+	else
+	    printf("ERROR: Dimension=%dx%d, %d errors\n", width, height, err);    
 	printf("E.g., \n");
 	printf("You have dst[%d][%d].{red,green,blue} = {%d,%d,%d}\n",
 	       badi, badj, wrong.red, wrong.green, wrong.blue);
@@ -573,6 +773,96 @@ static int check_convolve(int dim) {
     return err;
 }
 
+static int check_convolve(int dim) {
+    return check_convolve_rect(dim, dim, dim, dim);
+}
+
+/*
+ * transform_index - Where pixel (i,j) of a width x height image goes
+ *     under t, with dst rows stride apart. The rotates and transposes
+ *     make dst height x width.
+ */
+static int transform_index(flip_transform t, int i, int j, int width, int height, int stride)
+{
+    int swap = (t & FLIP_SWAP) != 0;
+    int rows = swap ? width : height;
+    int cols = swap ? height : width;
+    int r = swap ? j : i;
+    int c = swap ? i : j;
+
+    if (t & FLIP_ROWS_REV)
+	r = rows - 1 - r;
+    if (t & FLIP_COLS_REV)
+	c = cols - 1 - c;
+    return RIDX(r, c, stride);
+}
+
+/*
+ * rect_flip_index - transform_index() for the team's mapping
+ */
+static int rect_flip_index(int i, int j, int width, int height, int stride)
+{
+    return transform_index(flip_kind_transform[flip_kind], i, j, width, height, stride);
+}
+
+/*
+ * check_rect_padding - The padding at the end of each result row
+ *     (columns cols..stride-1) must still be black
+ */
+static int check_rect_padding(int rows, int cols, int stride)
+{
+    int i, j;
+
+    for (i = 0; i < rows; i++)
+	for (j = cols; j < stride; j++)
+	    if (result[RIDX(i,j,stride)].red || result[RIDX(i,j,stride)].green ||
+		result[RIDX(i,j,stride)].blue) {
+		printf("\n");
+		printf("ERROR: dst[%d][%d] is row padding and was written\n", i, j);
+		return 1;
+	    }
+    return 0;
+}
+
+/*
+ * check_flip_rect - check_flip() for a width x height image with src
+ *     rows src_stride apart and dst rows dst_stride apart
+ */
+static int check_flip_rect(int width, int height, int src_stride, int dst_stride) 
+{
+    int swap = (flip_kind_transform[flip_kind] & FLIP_SWAP) != 0;
+    int err = 0;
+    int i, j;
+    int badi = 0, badj = 0;
+
+    if (check_orig_rect(width, height, src_stride)) 
+	return 1; 
+
+    for (i = 0; i < height; i++)
+	for (j = 0; j < width; j++)
+	    if (compare_pixels(orig[RIDX(i,j,src_stride)],
+			       result[rect_flip_index(i, j, width, height, dst_stride)])) {
+		err++;
+		badi = i;
+		badj = j;
+	    }
+    if (err) {
+	pixel orig_bad = orig[RIDX(badi,badj,src_stride)];
+	pixel res_bad = result[rect_flip_index(badi, badj, width, height, dst_stride)];
+	printf("\n");
+	printf("ERROR: Dimension=%dx%d, %d errors\n", width, height, err);    
+	printf("E.g., The following two pixels should have equal value:\n");
+	printf("src[%d].{red,green,blue} = {%d,%d,%d}\n",
+	       RIDX(badi,badj,src_stride), orig_bad.red, orig_bad.green, orig_bad.blue);
+	printf("dst[%d].{red,green,blue} = {%d,%d,%d}\n",
+	       rect_flip_index(badi, badj, width, height, dst_stride),
+	       res_bad.red, res_bad.green, res_bad.blue);
+	return err;
+    }
+
+    return check_rect_padding(swap ? width : height, swap ? height : width, dst_stride);
+}
+
 
 void func_wrapper(void *arglist[]) 
 {
@@ -590,9 +880,138 @@ void func_wrapper(void *arglist[])
     return;
 }
 
+void inplace_wrapper(void *arglist[]) 
+{
+    pixel *img;
+    int mydim;
+    lab_inplace_func f;
+
+    f = (lab_inplace_func) arglist[0];
+    mydim = *((int *) arglist[1]);
+    img = (pixel *) arglist[3];
+
+    (*f)(mydim, img);
+
+    return;
+}
+
+void rect_wrapper(void *arglist[]) 
+{
+    pixel *src, *dst;
+    int *shape;   /* width, height, src stride, dst stride */
+    lab_rect_func f;
+
+    f = (lab_rect_func) arglist[0];
+    shape = (int *) arglist[1];
+    src = (pixel *) arglist[2];
+    dst = (pixel *) arglist[3];
+
+    (*f)(shape[0], shape[1], src, shape[2], dst, shape[3]);
+
+    return;
+}
+
+/*
+ * create_rect_bench - Lays out a width x height benchmark image with
+ *     RECT_PAD pixels of row padding in src and dst, and fills in
+ *     shape[] for rect_wrapper
+ */
+static void create_rect_bench(int flip, int width, int height, int shape[4])
+{
+    int swap = flip && (flip_kind_transform[flip_kind] & FLIP_SWAP);
+
+    shape[0] = width;
+    shape[1] = height;
+    shape[2] = width + RECT_PAD;
+    shape[3] = (swap ? height : width) + RECT_PAD;
+    create_rect(width, height, shape[2], (swap ? width : height) * shape[3]);
+}
+
+/*
+ * check_rect_bench - Runs a rectangular benchmark once on a width x
+ *     height image and checks the result. Returns nonzero on failure.
+ */
+static int check_rect_bench(bench_t *b, int flip, int width, int height)
+{
+    int shape[4];
+    int err;
+
+    create_rect_bench(flip, width, height, shape);
+    b->rfunct(width, height, orig, shape[2], result, shape[3]);
+    if (flip)
+	err = check_flip_rect(width, height, shape[2], shape[3]);
+    else
+	err = check_convolve_rect(width, height, shape[2], shape[3]) ||
+	    check_rect_padding(height, width, shape[3]);
+    if (err)
+	printf("Benchmark \"%s\" failed correctness check for dimension %dx%d.\n",
+	       b->description, width, height);
+    return err;
+}
+
+/*
+ * test_rect - Checks and times a rectangular flip or convolve on the
+ *     test_dim_rect shapes. There are no baselines for these shapes,
+ *     so only CPEs are printed and the best score is left alone.
+ */
+void test_rect(bench_t *b, int flip) 
+{
+    int i;
+    int test_num;
+
+    /* Check an odd, non-square shape once */
+    if (check_rect_bench(b, flip, ODD_DIM, ODD_HEIGHT))
+	return;
+
+    for (test_num = 0; test_num < DIM_CNT; test_num++) {
+	int width = test_dim_rect[test_num][0];
+	int height = test_dim_rect[test_num][1];
+
+	/* Check the benchmark shape */
+	if (check_rect_bench(b, flip, width, height))
+	    return;
+
+	/* Measure CPE */
+	{
+	    double num_cycles;
+	    int shape[4];
+	    void *arglist[4];
+
+	    create_rect_bench(flip, width, height, shape);
+	    arglist[0] = (void *) b->rfunct;
+	    arglist[1] = (void *) shape;
+	    arglist[2] = (void *) orig;
+	    arglist[3] = (void *) result;
+	    num_cycles = fcyc_v((test_funct_v)&rect_wrapper, arglist); 
+	    b->cpes[test_num] = num_cycles/((double) width*height);
+	}
+    }
+
+    /* Print results as a table */
+    printf("%s: Version = %s:\n", flip ? "flip" : "convolve", b->description);
+    printf("Dim\t");
+    for (i = 0; i < DIM_CNT; i++)
+	printf("\t%dx%d", test_dim_rect[i][0], test_dim_rect[i][1]);
+    printf("\n");
+
+    printf("Your CPEs");
+    for (i = 0; i < DIM_CNT; i++)
+	printf("\t%.2f", b->cpes[i]);
+    printf("\n\n");
+}
+
+/*
+ * run_flip_benchmark - In-place flips get a copy of orig in result
+ *     and flip it there
+ */
 void run_flip_benchmark(int idx, int dim) 
 {
-    benchmarks_flip[idx].tfunct(dim, orig, result);
+    if (benchmarks_flip[idx].ifunct) {
+        memcpy(result, orig, dim*dim*sizeof(pixel));
+        benchmarks_flip[idx].ifunct(dim, result);
+    }
+    else
+        benchmarks_flip[idx].tfunct(dim, orig, result);
 }
 
 void test_flip(int bench_index) 
@@ -600,6 +1019,11 @@ void test_flip(int bench_index)
     int i;
     int test_num;
     char *description = benchmarks_flip[bench_index].description;
+
+    if (benchmarks_flip[bench_index].rfunct) {
+	test_rect(&benchmarks_flip[bench_index], 1);
+	return;
+    }
   
     for (test_num = 0; test_num < DIM_CNT; test_num++) {
 		int dim;
@@ -607,7 +1031,7 @@ void test_flip(int bench_index)
 		/* Check for odd dimension */
 		create(ODD_DIM);
 		run_flip_benchmark(bench_index, ODD_DIM);
-		if (check_flip(ODD_DIM)) {
+		if (check_flip(ODD_DIM, benchmarks_flip[bench_index].ifunct != NULL)) {
 			printf("Benchmark \"%s\" failed correctness check for dimension %d.\n",
 			   benchmarks_flip[bench_index].description, ODD_DIM);
 			return;
@@ -622,7 +1046,7 @@ void test_flip(int bench_index)
 
 		/* Check that the code works */
 		run_flip_benchmark(bench_index, dim);
-		if (check_flip(dim)) {
+		if (check_flip(dim, benchmarks_flip[bench_index].ifunct != NULL)) {
 			printf("Benchmark \"%s\" failed correctness check for dimension %d.\n",
 			   benchmarks_flip[bench_index].description, dim);
 			return;
@@ -639,13 +1063,17 @@ void test_flip(int bench_index)
 			printf("DEBUG: dimension=%.2f\n",dimension);
 			printf("DEBUG: work=%.2f\n",work);
 	#endif
-			arglist[0] = (void *) benchmarks_flip[bench_index].tfunct;
+			arglist[0] = benchmarks_flip[bench_index].ifunct ?
+				(void *) benchmarks_flip[bench_index].ifunct :
+				(void *) benchmarks_flip[bench_index].tfunct;
 			arglist[1] = (void *) &tmpdim;
 			arglist[2] = (void *) orig;
 			arglist[3] = (void *) result;
 
 			create(dim);
-			num_cycles = fcyc_v((test_funct_v)&func_wrapper, arglist); 
+			num_cycles = fcyc_v(benchmarks_flip[bench_index].ifunct ?
+					    (test_funct_v)&inplace_wrapper :
+					    (test_funct_v)&func_wrapper, arglist); 
 			cpe = num_cycles/work;
 			benchmarks_flip[bench_index].cpes[test_num] = cpe;
 		}
@@ -658,7 +1086,9 @@ void test_flip(int bench_index)
     printf("Dim\t");
     for (i = 0; i < DIM_CNT; i++)
 	printf("\t%d", test_dim_flip[i]);
-    printf("\tMean\n");
+    if (!benchmarks_flip[bench_index].ifunct)
+	printf("\tMean");
+    printf("\n");
   
     printf("Your CPEs");
     for (i = 0; i < DIM_CNT; i++) {
@@ -666,6 +1096,13 @@ void test_flip(int bench_index)
     }
     printf("\n");
 
+    /* In-place flips skip the copy the baseline pays for, so only
+       their CPEs are shown and they never set the graded score */
+    if (benchmarks_flip[bench_index].ifunct) {
+	printf("\n");
+	return;
+    }
+
     printf("Baseline CPEs");
     for (i = 0; i < DIM_CNT; i++) {
 	printf("\t%.2f", flip_baseline_cpes[i]);
@@ -693,6 +1130,7 @@ void test_flip(int bench_index)
 	mean = pow(prod, 1.0/(double) DIM_CNT);
 	printf("\t%.2f", mean);
 	printf("\n\n");
+
 	if (mean > flip_maxmean) {
 	    flip_maxmean = mean;
 	    flip_maxmean_desc = benchmarks_flip[bench_index].description;
@@ -709,6 +1147,11 @@ void test_convolve(int bench_index)
     int i;
     int test_num;
     char *description = benchmarks_convolve[bench_index].description;
+
+    if (benchmarks_convolve[bench_index].rfunct) {
+	test_rect(&benchmarks_convolve[bench_index], 0);
+	return;
+    }
   
     for(test_num=0; test_num < DIM_CNT; test_num++) {
 	int dim;
@@ -809,16 +1252,1032 @@ void test_convolve(int bench_index)
     return;  
 }
 
+/*
+ * Library checks (-c). Each check runs one of the kernels.c APIs
+ * the benchmarks don't cover against the reference code, reports
+ * the first thing that is wrong and returns nonzero. They run
+ * instead of the benchmarks and the exit status says if any failed.
+ */
+typedef int (*lib_check_func)(void);
+
+/*
+ * use_kernel - Makes built-in kernel k (0..NUM_CONVOLUTION_KERNELS-1)
+ *     the active one; use_kernel(team_hash) puts the team's back
+ */
+static void use_kernel(unsigned int k)
+{
+    copy_kernel(get_convolution_kernel(k));
+}
+
+/*
+ * check_int_scale - The integer convolve's multiply-shift against the
+ *     float divide, exhaustively, for every built-in kernel
+ */
+static int check_int_scale(void)
+{
+    int k;
+
+    for (k = 0; k < NUM_CONVOLUTION_KERNELS; k++) {
+	use_kernel(k);
+	if (!int_convolve_verify()) {
+	    printf("ERROR: integer scale step is wrong for built-in kernel %d\n", k);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * check_convolved - result against check_convolution() of orig for
+ *     the active kernel; what names the code under test
+ */
+static int check_convolved(int dim, const char *what)
+{
+    int i, j;
+
+    for (i = 0; i < dim; i++)
+	for (j = 0; j < dim; j++) {
+	    pixel want = check_convolution(dim, dim, dim, i, j, orig);
+	    pixel got = result[RIDX(i,j,dim)];
+	    if (compare_pixels(got, want)) {
+		printf("ERROR: %s, dimension=%d: dst[%d][%d] is {%d,%d,%d}, should be {%d,%d,%d}\n",
+		       what, dim, i, j, got.red, got.green, got.blue,
+		       want.red, want.green, want.blue);
+		return 1;
+	    }
+	}
+    return 0;
+}
+
+/*
+ * check_spec - spec_convolve() for every built-in kernel. It must
+ *     find the kernel's specialized loop, which only works while
+ *     kernels.c's BUILTIN_KERNELS lists the kernels above in order,
+ *     and match check_convolution().
+ */
+static int check_spec(void)
+{
+    int k;
+
+    for (k = 0; k < NUM_CONVOLUTION_KERNELS; k++) {
+	use_kernel(k);
+	if (spec_convolve_kernel() != k) {
+	    printf("ERROR: spec_convolve finds entry %d of BUILTIN_KERNELS for built-in kernel %d\n",
+		   spec_convolve_kernel(), k);
+	    return 1;
+	}
+	create(ODD_DIM);
+	spec_convolve(ODD_DIM, orig, result);
+	if (check_convolved(ODD_DIM, "spec_convolve"))
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * check_jit - Compiles, checks and releases every built-in kernel in
+ *     turn; there are more of them than JIT slots, so this only works
+ *     if jit_release() really gives slots back
+ */
+static int check_jit(void)
+{
+    int k;
+
+    for (k = 0; k < NUM_CONVOLUTION_KERNELS; k++) {
+	lab_test_func f;
+	int err;
+
+	use_kernel(k);
+	f = jit_compile_convolve(get_convolution_kernel(k));
+	if (!f) {
+	    printf("ERROR: no JIT slot free for built-in kernel %d\n", k);
+	    return 1;
+	}
+	create(ODD_DIM);
+	f(ODD_DIM, orig, result);
+	err = check_convolved(ODD_DIM, "jit_compile_convolve");
+	jit_release(f);
+	if (err)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * check_nkernel_pixel - check_convolution() for a size x size nkernel
+ */
+static pixel check_nkernel_pixel(int dim, const nkernel *k, int i, int j)
+{
+    int r = k->size / 2, ii, jj;
+    float sum0 = 0, sum1 = 0, sum2 = 0, weight = 0;
+    pixel p;
+
+    for (ii = i - r; ii <= i + r; ii++)
+	for (jj = j - r; jj <= j + r; jj++) {
+	    float t;
+	    if (ii < 0 || ii >= dim || jj < 0 || jj >= dim)
+		continue;
+	    t = k->taps[(ii-i+r)*k->size + jj-j+r];
+	    sum0 += orig[RIDX(ii,jj,dim)].red * t;
+	    sum1 += orig[RIDX(ii,jj,dim)].green * t;
+	    sum2 += orig[RIDX(ii,jj,dim)].blue * t;
+	    weight += t;
+	}
+    p.red = (unsigned short) (sum0/weight);
+    p.green = (unsigned short) (sum1/weight);
+    p.blue = (unsigned short) (sum2/weight);
+    return p;
+}
+
+/*
+ * check_close - Every channel of result within tol of want
+ */
+static int check_close(int dim, const pixel *want, int tol, const char *what, int size)
+{
+    int p, c;
+
+    for (p = 0; p < dim*dim; p++)
+	for (c = 0; c < 3; c++) {
+	    int got = (&result[p].red)[c], expect = (&want[p].red)[c];
+	    if (got - expect > tol || expect - got > tol) {
+		printf("ERROR: %s, %dx%d kernel, dimension=%d: dst[%d][%d] channel %d is %d, should be %d (+-%d)\n",
+		       what, size, size, dim, p / dim, p % dim, c, got, expect, tol);
+		return 1;
+	    }
+	}
+    return 0;
+}
+
+/*
+ * check_nkernel_case - One size x size kernel of random positive taps
+ *     through both nkernel paths. Integer taps are exact on both; for
+ *     other taps the direct path may differ from the reference by the
+ *     weight's rounding and the FFT by 1 from the direct path.
+ */
+static int check_nkernel_case(int size, int integer)
+{
+    nkernel *k = nkernel_alloc(size);
+    pixel *want = malloc(ODD_DIM*ODD_DIM*sizeof(pixel));
+    pixel *direct = malloc(ODD_DIM*ODD_DIM*sizeof(pixel));
+    int i, j, err = 1;
+
+    if (!k || !want || !direct) {
+	printf("ERROR: out of memory for a %dx%d kernel\n", size, size);
+	goto out;
+    }
+    for (i = 0; i < size*size; i++)
+	k->taps[i] = integer ? random_in_interval(1, 5) :
+	    random_in_interval(1, 2000) / 1000.0f;
+    create(ODD_DIM);
+    for (i = 0; i < ODD_DIM; i++)
+	for (j = 0; j < ODD_DIM; j++)
+	    want[RIDX(i,j,ODD_DIM)] = check_nkernel_pixel(ODD_DIM, k, i, j);
+
+    nkernel_convolve_direct(ODD_DIM, k, orig, result);
+    if (check_close(ODD_DIM, want, !integer, "nkernel_convolve_direct", size))
+	goto out;
+    memcpy(direct, result, ODD_DIM*ODD_DIM*sizeof(pixel));
+    nkernel_convolve_fft(ODD_DIM, k, orig, result);
+    err = check_close(ODD_DIM, integer ? want : direct, !integer,
+		      "nkernel_convolve_fft", size);
+
+ out:
+    nkernel_free(k);
+    free(want);
+    free(direct);
+    return err;
+}
+
+/*
+ * check_nkernels - 3x3 and 7x7 integer kernels (exact), and 7x7, 31x31
+ *     and 101x101 (wider than the image) kernels with fractional taps
+ */
+static int check_nkernels(void)
+{
+    return check_nkernel_case(3, 1) || check_nkernel_case(7, 1) ||
+	check_nkernel_case(7, 0) || check_nkernel_case(31, 0) ||
+	check_nkernel_case(101, 0);
+}
+
+/*
+ * check_batch - All the built-in kernels through one convolve_batch()
+ *     call, each output against check_convolution()
+ */
+static int check_batch(void)
+{
+    Kernel *ks[NUM_CONVOLUTION_KERNELS];
+    pixel *dsts[NUM_CONVOLUTION_KERNELS];
+    int k, err = 0;
+
+    create(ODD_DIM);
+    for (k = 0; k < NUM_CONVOLUTION_KERNELS; k++) {
+	ks[k] = get_convolution_kernel(k);
+	dsts[k] = malloc(ODD_DIM*ODD_DIM*sizeof(pixel));
+	if (!dsts[k]) {
+	    printf("ERROR: out of memory for convolve_batch outputs\n");
+	    while (k--)
+		free(dsts[k]);
+	    return 1;
+	}
+    }
+    if (convolve_batch(ODD_DIM, ks, NUM_CONVOLUTION_KERNELS, orig, dsts)) {
+	printf("ERROR: convolve_batch failed\n");
+	err = 1;
+    }
+    for (k = 0; k < NUM_CONVOLUTION_KERNELS && !err; k++) {
+	use_kernel(k);
+	memcpy(result, dsts[k], ODD_DIM*ODD_DIM*sizeof(pixel));
+	err = check_convolved(ODD_DIM, "convolve_batch");
+    }
+    for (k = 0; k < NUM_CONVOLUTION_KERNELS; k++)
+	free(dsts[k]);
+    return err;
+}
+
+/*
+ * gradient_channel - sqrt(qx^2 + qy^2) of two check_convolution()
+ *     quotients before truncation, a zero weight counting as 0 and
+ *     the result saturated to a channel
+ */
+static unsigned short gradient_channel(float sx, float wx, float sy, float wy)
+{
+    float qx = wx != 0.0f ? sx / wx : 0.0f;
+    float qy = wy != 0.0f ? sy / wy : 0.0f;
+    float m = sqrtf(qx * qx + qy * qy);
+
+    return m >= 65535.0f ? 65535 : (unsigned short) m;
+}
+
+/*
+ * kernel_sums - check_convolution()'s channel sums and weight at
+ *     (i,j) for kernel ker
+ */
+static void kernel_sums(int dim, Kernel *ker, int i, int j, float sum[3], float *weight)
+{
+    int ii, jj;
+
+    sum[0] = sum[1] = sum[2] = *weight = 0;
+    for (ii = i - 2; ii <= i + 2; ii++)
+	for (jj = j - 2; jj <= j + 2; jj++) {
+	    float t;
+	    if (ii < 0 || ii >= dim || jj < 0 || jj >= dim)
+		continue;
+	    t = (*ker)[ii-i+2][jj-j+2];
+	    sum[0] += orig[RIDX(ii,jj,dim)].red * t;
+	    sum[1] += orig[RIDX(ii,jj,dim)].green * t;
+	    sum[2] += orig[RIDX(ii,jj,dim)].blue * t;
+	    *weight += t;
+	}
+}
+
+/*
+ * check_gradient - convolve_gradient() for each neighbouring pair of
+ *     built-in kernels against the per-kernel sums and magnitude
+ */
+static int check_gradient(void)
+{
+    int k, i, j, c;
+
+    create(ODD_DIM);
+    for (k = 0; k + 1 < NUM_CONVOLUTION_KERNELS; k++) {
+	Kernel *kx = get_convolution_kernel(k), *ky = get_convolution_kernel(k + 1);
+
+	if (convolve_gradient(ODD_DIM, kx, ky, orig, result)) {
+	    printf("ERROR: convolve_gradient failed\n");
+	    return 1;
+	}
+	for (i = 0; i < ODD_DIM; i++)
+	    for (j = 0; j < ODD_DIM; j++) {
+		float sx[3], sy[3], wx, wy;
+		kernel_sums(ODD_DIM, kx, i, j, sx, &wx);
+		kernel_sums(ODD_DIM, ky, i, j, sy, &wy);
+		for (c = 0; c < 3; c++) {
+		    unsigned short want = gradient_channel(sx[c], wx, sy[c], wy);
+		    unsigned short got = (&result[RIDX(i,j,ODD_DIM)].red)[c];
+		    if (got != want) {
+			printf("ERROR: convolve_gradient, kernels %d and %d: dst[%d][%d] channel %d is %d, should be %d\n",
+			       k, k + 1, i, j, c, got, want);
+			return 1;
+		    }
+		}
+	    }
+    }
+    return 0;
+}
+
+/*
+ * check_flip_convolve - flip_convolve() for every mapping and built-in
+ *     kernel against check_convolution() of the flipped image
+ */
+static int check_flip_convolve(void)
+{
+    FlippedFunc team_f = RIDX_F;
+    pixel *flipped = malloc(ODD_DIM*ODD_DIM*sizeof(pixel));
+    int m, k, i, j, err = 0;
+
+    if (!flipped) {
+	printf("ERROR: out of memory for the flipped image\n");
+	return 1;
+    }
+    for (m = 0; m < 7 && !err; m++)
+	for (k = 0; k < NUM_CONVOLUTION_KERNELS && !err; k++) {
+	    RIDX_F = flip_kind_func[m];
+	    use_kernel(k);
+	    create(ODD_DIM);
+	    for (i = 0; i < ODD_DIM; i++)
+		for (j = 0; j < ODD_DIM; j++)
+		    flipped[RIDX_F(i,j,ODD_DIM)] = orig[RIDX(i,j,ODD_DIM)];
+	    flip_convolve(ODD_DIM, orig, result);
+	    for (i = 0; i < ODD_DIM && !err; i++)
+		for (j = 0; j < ODD_DIM && !err; j++) {
+		    pixel want = check_convolution(ODD_DIM, ODD_DIM, ODD_DIM, i, j, flipped);
+		    pixel got = result[RIDX(i,j,ODD_DIM)];
+		    if (compare_pixels(got, want)) {
+			printf("ERROR: flip_convolve, mapping %d, kernel %d: dst[%d][%d] is {%d,%d,%d}, should be {%d,%d,%d}\n",
+			       m, k, i, j, got.red, got.green, got.blue,
+			       want.red, want.green, want.blue);
+			err = 1;
+		    }
+		}
+	}
+    RIDX_F = team_f;
+    free(flipped);
+    return err;
+}
+
+/*
+ * check_flip_mappings - Every registered flip for all seven RIDX_F
+ *     mappings. flip() is skipped: it is the student's version for
+ *     the team's mapping alone. In-place flips start from a copy of
+ *     orig in result; rectangular ones go through check_rect_bench()
+ *     at ODD_DIM x ODD_HEIGHT. PERFLAB_LLC_BYTES is set low so
+ *     stream_flip takes its non-temporal path at ODD_DIM.
+ */
+static int check_flip_mappings(void)
+{
+    FlippedFunc team_f = RIDX_F;
+    int team_kind = flip_kind;
+    int b, m, i, j, err = 0;
+
+    setenv("PERFLAB_LLC_BYTES", "4096", 1);
+    for (b = 0; b < flip_benchmark_count && !err; b++) {
+	bench_t *bench = &benchmarks_flip[b];
+
+	if (bench->tfunct == flip)
+	    continue;
+	for (m = 0; m < 7 && !err; m++) {
+	    RIDX_F = flip_kind_func[m];
+	    flip_kind = m;
+	    if (bench->rfunct) {
+		if ((err = check_rect_bench(bench, 1, ODD_DIM, ODD_HEIGHT)))
+		    printf("ERROR: %s fails for mapping %d\n", bench->description, m);
+		continue;
+	    }
+	    create(ODD_DIM);
+	    if (bench->ifunct) {
+		memcpy(result, orig, ODD_DIM*ODD_DIM*sizeof(pixel));
+		bench->ifunct(ODD_DIM, result);
+	    }
+	    else
+		bench->tfunct(ODD_DIM, orig, result);
+	    for (i = 0; i < ODD_DIM && !err; i++)
+		for (j = 0; j < ODD_DIM && !err; j++) {
+		    pixel want = orig[RIDX(i,j,ODD_DIM)];
+		    pixel got = result[RIDX_F(i,j,ODD_DIM)];
+		    if (compare_pixels(got, want)) {
+			printf("ERROR: %s, mapping %d: src[%d][%d] is {%d,%d,%d}, its image is {%d,%d,%d}\n",
+			       bench->description, m, i, j, want.red, want.green, want.blue,
+			       got.red, got.green, got.blue);
+			err = 1;
+		    }
+		}
+	}
+    }
+    RIDX_F = team_f;
+    flip_kind = team_kind;
+    return err;
+}
+
+/*
+ * transform_image - dst = src (dim x dim) under t, pixel by pixel
+ */
+static void transform_image(flip_transform t, int dim, const pixel *src, pixel *dst)
+{
+    int i, j;
+
+    for (i = 0; i < dim; i++)
+	for (j = 0; j < dim; j++)
+	    dst[transform_index(t, i, j, dim, dim, dim)] = src[RIDX(i,j,dim)];
+}
+
+/*
+ * check_same - got against want, both dim x dim
+ */
+static int check_same(int dim, const pixel *want, const pixel *got, const char *what)
+{
+    int p;
+
+    for (p = 0; p < dim*dim; p++)
+	if (compare_pixels(got[p], want[p])) {
+	    printf("ERROR: %s, dimension=%d: dst[%d][%d] is {%d,%d,%d}, should be {%d,%d,%d}\n",
+		   what, dim, p / dim, p % dim, got[p].red, got[p].green, got[p].blue,
+		   want[p].red, want[p].green, want[p].blue);
+	    return 1;
+	}
+    return 0;
+}
+
+/* Rows per flip_view_rows() call in check_views(); doesn't divide ODD_DIM */
+#define VIEW_CHECK_BAND 7
+
+/*
+ * check_views - Every way of reading a flip_view (FLIP_VIEW_AT, row
+ *     bands, materialize, pixels) for all eight transforms against
+ *     the transform done pixel by pixel; for the team's mapping that
+ *     is what flip() must produce
+ */
+static int check_views(void)
+{
+    pixel *want = malloc(ODD_DIM*ODD_DIM*sizeof(pixel));
+    char what[64];
+    int t, i, j, r, err = 0;
+
+    if (!want) {
+	printf("ERROR: out of memory for the view check\n");
+	return 1;
+    }
+    create(ODD_DIM);
+    for (t = 0; t < 8 && !err; t++) {
+	flip_view v;
+	pixel *p;
+
+	transform_image(t, ODD_DIM, orig, want);
+	flip_view_init(&v, t, ODD_DIM, orig);
+
+	sprintf(what, "FLIP_VIEW_AT, transform %d", t);
+	for (i = 0; i < ODD_DIM; i++)
+	    for (j = 0; j < ODD_DIM; j++)
+		result[RIDX(i,j,ODD_DIM)] = FLIP_VIEW_AT(&v, i, j);
+	err = check_same(ODD_DIM, want, result, what);
+
+	sprintf(what, "flip_view_rows, transform %d", t);
+	for (r = 0; r < ODD_DIM && !err; r += VIEW_CHECK_BAND)
+	    flip_view_rows(&v, r, ODD_DIM - r < VIEW_CHECK_BAND ? ODD_DIM - r : VIEW_CHECK_BAND,
+			   &result[RIDX(r,0,ODD_DIM)]);
+	err = err || check_same(ODD_DIM, want, result, what);
+
+	sprintf(what, "flip_view_materialize, transform %d", t);
+	flip_view_materialize(&v, result);
+	err = err || check_same(ODD_DIM, want, result, what);
+
+	sprintf(what, "flip_view_pixels, transform %d", t);
+	p = flip_view_pixels(&v);
+	err = err || !p || check_same(ODD_DIM, want, p, what);
+
+	/* and again once the copy exists */
+	sprintf(what, "flip_view_materialize of a copy, transform %d", t);
+	flip_view_materialize(&v, result);
+	err = err || check_same(ODD_DIM, want, result, what);
+	flip_view_release(&v);
+    }
+    err = err || check_orig(ODD_DIM);
+    free(want);
+    return err;
+}
+
+/*
+ * check_compose - All 8x8 pairs of transforms: flip_compose() must
+ *     equal applying the two in turn, and flip_chain() (out of place
+ *     and in place) and flip_view_apply() must produce that image
+ */
+static int check_compose(void)
+{
+    size_t bytes = ODD_DIM*ODD_DIM*sizeof(pixel);
+    pixel *once = malloc(bytes), *want = malloc(bytes), *img = malloc(bytes);
+    char what[64];
+    int a, b, err = 0;
+
+    if (!once || !want || !img) {
+	printf("ERROR: out of memory for the composition check\n");
+	err = 1;
+    }
+    create(ODD_DIM);
+    for (a = 0; a < 8 && !err; a++)
+	for (b = 0; b < 8 && !err; b++) {
+	    flip_transform chain[2] = {a, b};
+	    flip_transform t = flip_compose(a, b);
+	    flip_view v;
+
+	    transform_image(a, ODD_DIM, orig, once);
+	    transform_image(b, ODD_DIM, once, want);
+
+	    sprintf(what, "flip_compose(%d, %d) = %d", a, b, t);
+	    transform_image(t, ODD_DIM, orig, result);
+	    err = check_same(ODD_DIM, want, result, what);
+
+	    sprintf(what, "flip_compose_chain(%d, %d)", a, b);
+	    if (!err && flip_compose_chain(chain, 2) != t) {
+		printf("ERROR: %s is %d, should be %d\n", what, flip_compose_chain(chain, 2), t);
+		err = 1;
+	    }
+
+	    sprintf(what, "flip_chain(%d, %d)", a, b);
+	    flip_chain(ODD_DIM, chain, 2, orig, result);
+	    err = err || check_same(ODD_DIM, want, result, what);
+
+	    sprintf(what, "flip_chain(%d, %d) in place", a, b);
+	    memcpy(img, orig, bytes);
+	    flip_chain(ODD_DIM, chain, 2, img, img);
+	    err = err || check_same(ODD_DIM, want, img, what);
+
+	    sprintf(what, "flip_view_apply(%d, %d)", a, b);
+	    flip_view_init(&v, a, ODD_DIM, orig);
+	    flip_view_apply(&v, b);
+	    flip_view_materialize(&v, result);
+	    flip_view_release(&v);
+	    err = err || check_same(ODD_DIM, want, result, what);
+	}
+    err = err || check_orig(ODD_DIM);
+    free(once);
+    free(want);
+    free(img);
+    return err;
+}
+
+/*
+ * halo_coord - Where halo coordinate x (in [-HALO, dim+HALO)) of a
+ *     dim-wide image reads from in mode, or -1 for a zero
+ */
+static int halo_coord(halo_mode mode, int x, int dim)
+{
+    if (x >= 0 && x < dim)
+	return x;
+    switch (mode) {
+    case HALO_CLAMP:
+	return x < 0 ? 0 : dim - 1;
+    case HALO_MIRROR:
+	return x < 0 ? -x : 2*(dim - 1) - x;
+    case HALO_WRAP:
+	return (x + dim) % dim;
+    default:
+	return -1;
+    }
+}
+
+/*
+ * check_halo_pixel - What halo_convolve() must give at (i,j) of the
+ *     dim x dim image src in mode: check_convolution() for the zero
+ *     halo, otherwise every tap reads src through halo_coord() and
+ *     the sums are divided by the full tap sum
+ */
+static pixel check_halo_pixel(halo_mode mode, int dim, int i, int j, pixel *src)
+{
+    pixel result;
+    float sum0, sum1, sum2, weight;
+    int ii, jj;
+
+    if (mode == HALO_ZERO)
+	return check_convolution(dim, dim, dim, i, j, src);
+    sum0 = sum1 = sum2 = weight = 0;
+    for (ii = 0; ii < 5; ii++)
+	for (jj = 0; jj < 5; jj++) {
+	    pixel p = src[RIDX(halo_coord(mode, i+ii-2, dim), halo_coord(mode, j+jj-2, dim), dim)];
+	    sum0 += p.red * kernel[ii][jj];
+	    sum1 += p.green * kernel[ii][jj];
+	    sum2 += p.blue * kernel[ii][jj];
+	    weight += kernel[ii][jj];
+	}
+    result.red = (unsigned short) (sum0/weight);
+    result.green = (unsigned short) (sum1/weight);
+    result.blue = (unsigned short) (sum2/weight);
+    return result;
+}
+
+/*
+ * check_halo_same - Frame and halo of img against a halo image freshly
+ *     filled from src in img's mode
+ */
+static int check_halo_same(const halo_image *img, pixel *src, const char *what)
+{
+    halo_image fresh;
+    int r, c, err = 0;
+
+    if (!halo_alloc(&fresh, img->dim, img->mode)) {
+	printf("ERROR: out of memory for a halo image\n");
+	return 1;
+    }
+    halo_load_rows(&fresh, src, 0, img->dim);
+    for (r = -HALO; r < img->dim + HALO && !err; r++)
+	for (c = -HALO; c < img->dim + HALO && !err; c++)
+	    if (compare_pixels(img->pixels[RIDX(r,c,img->stride)],
+			       fresh.pixels[RIDX(r,c,fresh.stride)])) {
+		printf("ERROR: %s, mode %d: cell (%d,%d) differs from a freshly filled image\n",
+		       what, img->mode, r, c);
+		err = 1;
+	    }
+    halo_free(&fresh);
+    return err;
+}
+
+/* Row bands check_halo() reloads: the edge rows the halo shows and
+   one in between */
+static const int halo_bands[][2] = {{0, 1}, {ODD_DIM-2, ODD_DIM}, {40, 47}};
+
+/*
+ * check_halo - For each boundary mode: halo_convolve() for every
+ *     built-in kernel against check_halo_pixel(); halo_load_rows() of
+ *     a few row bands, and halo_fill() after switching to each mode,
+ *     against an image filled from scratch
+ */
+static int check_halo(void)
+{
+    pixel *mixed = malloc(ODD_DIM*ODD_DIM*sizeof(pixel));
+    halo_image img;
+    int mode, to, k, b, i, j, err = 0;
+
+    if (!mixed) {
+	printf("ERROR: out of memory for the halo check\n");
+	return 1;
+    }
+    for (mode = HALO_ZERO; mode <= HALO_WRAP && !err; mode++) {
+	if (!halo_alloc(&img, ODD_DIM, mode)) {
+	    printf("ERROR: out of memory for a halo image\n");
+	    err = 1;
+	    break;
+	}
+	for (k = 0; k < NUM_CONVOLUTION_KERNELS && !err; k++) {
+	    use_kernel(k);
+	    create(ODD_DIM);
+	    halo_load_rows(&img, orig, 0, ODD_DIM);
+	    if (halo_convolve(&img, result)) {
+		printf("ERROR: halo_convolve ran out of memory\n");
+		err = 1;
+	    }
+	    for (i = 0; i < ODD_DIM && !err; i++)
+		for (j = 0; j < ODD_DIM && !err; j++) {
+		    pixel want = check_halo_pixel(mode, ODD_DIM, i, j, orig);
+		    pixel got = result[RIDX(i,j,ODD_DIM)];
+		    if (compare_pixels(got, want)) {
+			printf("ERROR: halo_convolve, mode %d, kernel %d: dst[%d][%d] is {%d,%d,%d}, should be {%d,%d,%d}\n",
+			       mode, k, i, j, got.red, got.green, got.blue,
+			       want.red, want.green, want.blue);
+			err = 1;
+		    }
+		}
+	}
+
+	/* img holds the last orig; load bands of a new one over it */
+	memcpy(mixed, orig, ODD_DIM*ODD_DIM*sizeof(pixel));
+	create(ODD_DIM);
+	for (b = 0; b < (int) (sizeof(halo_bands)/sizeof(halo_bands[0])) && !err; b++) {
+	    int r0 = halo_bands[b][0], r1 = halo_bands[b][1];
+	    halo_load_rows(&img, orig, r0, r1);
+	    memcpy(&mixed[RIDX(r0,0,ODD_DIM)], &orig[RIDX(r0,0,ODD_DIM)],
+		   (r1 - r0)*ODD_DIM*sizeof(pixel));
+	    err = check_halo_same(&img, mixed, "halo_load_rows");
+	}
+
+	for (to = HALO_ZERO; to <= HALO_WRAP && !err; to++) {
+	    img.mode = to;
+	    halo_fill(&img);
+	    err = check_halo_same(&img, mixed, "halo_fill after a mode change");
+	}
+	halo_free(&img);
+    }
+    free(mixed);
+    return err;
+}
+
+/* Shape of the image check_stream() runs: odd both ways, and small
+   enough that all of it fits in a pipe's buffer */
+#define STREAM_WIDTH 45
+#define STREAM_HEIGHT 29
+
+/*
+ * stream_fds - A temp file (fd[0] == fd[1]) or a pipe (read end fd[0],
+ *     write end fd[1]). Returns nonzero on failure.
+ */
+static int stream_fds(int use_pipe, int fd[2])
+{
+    FILE *f;
+
+    if (use_pipe)
+	return pipe(fd);
+    if (!(f = tmpfile()))
+	return -1;
+    fd[0] = fd[1] = dup(fileno(f));
+    fclose(f);
+    return fd[0] < 0;
+}
+
+static void close_stream_fds(int use_pipe, int fd[2])
+{
+    close(fd[0]);
+    if (use_pipe && fd[1] >= 0)
+	close(fd[1]);
+}
+
+/*
+ * run_stream - Feeds the first n bytes of orig to convolve_stream_mmap()
+ *     or convolve_stream_fd() over temp files or pipes, and reads what
+ *     comes out into got. *ret gets what the stream function returned.
+ *     Returns nonzero if the files couldn't be set up.
+ */
+static int run_stream(int via_mmap, int use_pipe, size_t n, pixel *got, int *ret)
+{
+    size_t want = STREAM_WIDTH*STREAM_HEIGHT*sizeof(pixel), done = 0;
+    int in[2], out[2];
+    ssize_t r;
+
+    if (stream_fds(use_pipe, in))
+	return 1;
+    if (stream_fds(use_pipe, out)) {
+	close_stream_fds(use_pipe, in);
+	return 1;
+    }
+    if (write(in[1], orig, n) != (ssize_t) n) {
+	close_stream_fds(use_pipe, in);
+	close_stream_fds(use_pipe, out);
+	return 1;
+    }
+    if (use_pipe) {
+	close(in[1]);
+	in[1] = -1;
+    }
+    else
+	lseek(in[0], 0, SEEK_SET);
+
+    if (via_mmap)
+	*ret = convolve_stream_mmap(STREAM_WIDTH, STREAM_HEIGHT, in[0], out[1]);
+    else
+	*ret = convolve_stream_fd(STREAM_WIDTH, STREAM_HEIGHT, in[0], out[1]);
+
+    if (use_pipe) {
+	close(out[1]);
+	out[1] = -1;
+    }
+    else
+	lseek(out[0], 0, SEEK_SET);
+    memset(got, 0, want);
+    while (done < want && (r = read(out[0], (char *) got + done, want - done)) > 0)
+	done += r;
+    close_stream_fds(use_pipe, in);
+    close_stream_fds(use_pipe, out);
+    return 0;
+}
+
+/*
+ * check_stream - convolve_stream_fd() and convolve_stream_mmap() over
+ *     temp files and over pipes, against convolve_rect(). A pipe can't
+ *     be mapped, so convolve_stream_mmap() must turn one down with
+ *     STREAM_ERROR. Input cut a row short must give STREAM_EOF.
+ */
+static int check_stream(void)
+{
+    size_t bytes = STREAM_WIDTH*STREAM_HEIGHT*sizeof(pixel);
+    size_t cut = bytes - STREAM_WIDTH*sizeof(pixel);
+    pixel *got = malloc(bytes);
+    int via_mmap, use_pipe, ret, i, err = 0;
+
+    if (!got) {
+	printf("ERROR: out of memory for the stream check\n");
+	return 1;
+    }
+    create_rect(STREAM_WIDTH, STREAM_HEIGHT, STREAM_WIDTH, STREAM_WIDTH*STREAM_HEIGHT);
+    convolve_rect(STREAM_WIDTH, STREAM_HEIGHT, orig, STREAM_WIDTH, result, STREAM_WIDTH);
+    for (via_mmap = 0; via_mmap < 2 && !err; via_mmap++)
+	for (use_pipe = 0; use_pipe < 2 && !err; use_pipe++) {
+	    const char *what = via_mmap ? "convolve_stream_mmap" : "convolve_stream_fd";
+	    const char *over = use_pipe ? "a pipe" : "a file";
+	    int want = via_mmap && use_pipe ? STREAM_ERROR : 0;
+
+	    if (run_stream(via_mmap, use_pipe, bytes, got, &ret)) {
+		printf("ERROR: can't set up %s for %s\n", over, what);
+		err = 1;
+	    }
+	    else if (ret != want) {
+		printf("ERROR: %s over %s returns %d, should return %d\n", what, over, ret, want);
+		err = 1;
+	    }
+	    for (i = 0; i < STREAM_WIDTH*STREAM_HEIGHT && !err && !want; i++)
+		if (compare_pixels(got[i], result[i])) {
+		    printf("ERROR: %s over %s: dst[%d][%d] differs from convolve_rect's\n",
+			   what, over, i / STREAM_WIDTH, i % STREAM_WIDTH);
+		    err = 1;
+		}
+	    if (err || want)
+		continue;
+	    if (run_stream(via_mmap, use_pipe, cut, got, &ret)) {
+		printf("ERROR: can't set up %s for %s\n", over, what);
+		err = 1;
+	    }
+	    else if (ret != STREAM_EOF) {
+		printf("ERROR: %s over %s returns %d for input a row short, should return STREAM_EOF\n",
+		       what, over, ret);
+		err = 1;
+	    }
+	}
+    free(got);
+    return err;
+}
+
+static struct {
+    const char *name;
+    lib_check_func f;
+} lib_checks[] = {
+    {"int_convolve scale step", check_int_scale},
+    {"spec_convolve for the built-in kernels", check_spec},
+    {"jit_compile_convolve and jit_release", check_jit},
+    {"nkernel direct and FFT paths", check_nkernels},
+    {"convolve_batch", check_batch},
+    {"convolve_gradient", check_gradient},
+    {"flip_convolve", check_flip_convolve},
+    {"registered flips, all seven mappings", check_flip_mappings},
+    {"flip_view", check_views},
+    {"flip_compose and flip_chain", check_compose},
+    {"halo images, all four modes", check_halo},
+    {"convolve_stream_fd and _mmap", check_stream},
+};
+
+/*
+ * run_lib_checks - Runs every library check; returns how many failed
+ */
+static int run_lib_checks(void)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < (int) (sizeof(lib_checks)/sizeof(lib_checks[0])); i++) {
+	int err = lib_checks[i].f();
+	use_kernel(team_hash);
+	printf("%-40s %s\n", lib_checks[i].name, err ? "FAILED" : "ok");
+	failed += err != 0;
+    }
+    printf("%d of %d library checks failed\n", failed, i);
+    return failed;
+}
+
+
+/*
+ * Pixel format benchmarks (-F). Each pixel_format is checked and
+ * timed with format_flip() and format_convolve() at the flip and
+ * convolve dimensions. Besides CPE the table gives bytes moved per
+ * cycle, counting each pixel once read and once written.
+ */
+typedef void (*format_func)(const format_image *, format_image *);
+
+static void format_convolve_func(const format_image *src, format_image *dst)
+{
+    format_convolve(src, dst);
+}
+
+void format_wrapper(void *arglist[]) 
+{
+    format_func f = (format_func) arglist[0];
+
+    (*f)((const format_image *) arglist[2], (format_image *) arglist[3]);
+}
+
+/*
+ * format_value - Channel c of pixel p in img, as stored
+ */
+static float format_value(const format_image *img, long p, int c)
+{
+    switch (img->format) {
+    case FMT_RGB24:
+	return ((unsigned char *) img->data)[3*p + c];
+    case FMT_RGBX64:
+	return (&((pixel64 *) img->data)[p].red)[c];
+    case FMT_FLOAT_PLANES:
+	return ((float *) img->data)[(long) c*img->dim*img->dim + p];
+    default:
+	return (&((pixel *) img->data)[p].red)[c];
+    }
+}
+
+/*
+ * check_format - Checks dst = flip or convolve of src. orig must hold
+ *     src's channel values, so check_convolution() sees what the
+ *     format does; 8-bit results are compared on the low byte and
+ *     float results after truncation, as format_convolve() defines.
+ */
+static int check_format(int flip, int dim, const format_image *src, const format_image *dst)
+{
+    int i, j, c;
+
+    for (i = 0; i < dim; i++)
+	for (j = 0; j < dim; j++) {
+	    pixel want = {0,0,0};
+	    if (!flip)
+		want = check_convolution(dim, dim, dim, i, j, orig);
+	    for (c = 0; c < 3; c++) {
+		float got, expect;
+		if (flip) {
+		    got = format_value(dst, rect_flip_index(i, j, dim, dim, dim), c);
+		    expect = format_value(src, RIDX(i,j,dim), c);
+		} else {
+		    unsigned short w = (&want.red)[c];
+		    got = format_value(dst, RIDX(i,j,dim), c);
+		    if (dst->format == FMT_RGB24)
+			expect = w & 0xFF;
+		    else if (dst->format == FMT_FLOAT_PLANES) {
+			got = (unsigned short) got;
+			expect = w;
+		    }
+		    else
+			expect = w;
+		}
+		if (got != expect) {
+		    printf("\n");
+		    printf("ERROR: %s %s, dimension=%d: dst[%d][%d] channel %d is %.1f, should be %.1f\n",
+			   format_name(src->format), flip ? "flip" : "convolve",
+			   dim, i, j, c, got, expect);
+		    return 1;
+		}
+	    }
+	}
+    return 0;
+}
+
+/*
+ * run_format - Checks and times one format and operation at dim;
+ *     returns the CPE, or 0 on failure
+ */
+static double run_format(pixel_format fmt, int flip, int dim)
+{
+    format_func f = flip ? format_flip : format_convolve_func;
+    format_image src, dst;
+    void *arglist[4];
+    double cpe = 0.0;
+    long p;
+    int c;
+
+    if (!format_image_alloc(&src, fmt, dim) || !format_image_alloc(&dst, fmt, dim)) {
+	printf("Can't allocate %s images for dimension %d\n", format_name(fmt), dim);
+	exit(EXIT_FAILURE);
+    }
+    create(dim);
+    format_from_pixels(dim, orig, &src);
+    for (p = 0; p < (long) dim*dim; p++)
+	for (c = 0; c < 3; c++)
+	    (&orig[p].red)[c] = format_value(&src, p, c);
+
+    f(&src, &dst);
+    if (!check_format(flip, dim, &src, &dst)) {
+	arglist[0] = (void *) f;
+	arglist[2] = (void *) &src;
+	arglist[3] = (void *) &dst;
+	cpe = fcyc_v((test_funct_v)&format_wrapper, arglist)/((double) dim*dim);
+    }
+    format_image_free(&src);
+    format_image_free(&dst);
+    return cpe;
+}
+
+void test_formats(void) 
+{
+    int fmt, flip, i;
+
+    printf("Pixel formats (CPE, and bytes read+written per cycle at the mean CPE):\n");
+    printf("Format\t\tOp\t");
+    for (i = 0; i < DIM_CNT; i++)
+	printf("\t%d", test_dim_flip[i]);
+    printf("\tB/cycle\n");
+
+    for (fmt = 0; fmt < FMT_COUNT; fmt++)
+	for (flip = 1; flip >= 0; flip--) {
+	    double cpe, prod = 1.0;
+	    int *dims = flip ? test_dim_flip : test_dim_convolve;
+
+	    if (run_format(fmt, flip, ODD_DIM) == 0.0)
+		continue;
+	    printf("%-12s\t%s\t", format_name(fmt), flip ? "flip" : "convolve");
+	    for (i = 0; i < DIM_CNT; i++) {
+		cpe = run_format(fmt, flip, dims[i]);
+		if (cpe <= 0.0)
+		    break;
+		prod *= cpe;
+		printf("\t%.2f", cpe);
+	    }
+	    if (i == DIM_CNT)
+		printf("\t%.2f", 2.0*format_pixel_bytes(fmt)/pow(prod, 1.0/(double) DIM_CNT));
+	    printf("\n");
+	}
+    printf("\n");
+}
+
 
 void usage(char *progname) 
 {
-    fprintf(stderr, "Usage: %s [-hqg] [-f <func_file>] [-d <dump_file>]\n", progname);    
+    fprintf(stderr, "Usage: %s [-hqgFc] [-f <func_file>] [-d <dump_file>] [-D <dim>]\n", progname);    
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h         Print this message\n");
     fprintf(stderr, "  -q         Quit after dumping (use with -d )\n");
     fprintf(stderr, "  -g         Autograder mode: checks only flip() and convolve()\n");
     fprintf(stderr, "  -f <file>  Get test function names from dump file <file>\n");
     fprintf(stderr, "  -d <file>  Emit a dump file <file> for later use with -f\n");
+    fprintf(stderr, "  -D <dim>   Benchmark dimension <dim> in place of 2048 (e.g. 4096, 8192)\n");
+    fprintf(stderr, "  -F         Also benchmark flip and convolve in every pixel format\n");
+    fprintf(stderr, "  -c         Check the library APIs against the reference code and exit\n");
     exit(EXIT_FAILURE);
 }
 
@@ -832,6 +2291,9 @@ int main(int argc, char *argv[])
     char c = '0';
     char *bench_func_file = NULL;
     char *func_dump_file = NULL;
+    int large_dim = 0;
+    int formats = 0;
+    int lib_check = 0;
 
     /* register all the defined functions */
     register_flip_functions();
@@ -839,7 +2301,7 @@ int main(int argc, char *argv[])
 //    register_normalization_functions();
 
     /* parse command line args */
-    while ((c = getopt(argc, argv, "tgqf:d:s:h")) != -1)
+    while ((c = getopt(argc, argv, "tgqf:d:s:D:Fch")) != -1)
 	switch (c) {
 
 	case 't': /* skip student name check (hidden flag) */
@@ -883,6 +2345,22 @@ int main(int argc, char *argv[])
 	    }
 	    break;
 
+	case 'D': /* replace the largest benchmark dimension */
+	    large_dim = atoi(optarg);
+	    if (large_dim < 16)
+		usage(argv[0]);
+	    test_dim_flip[DIM_CNT-1] = large_dim;
+	    test_dim_convolve[DIM_CNT-1] = large_dim;
+	    break;
+
+	case 'F': /* benchmark every pixel format too */
+	    formats = 1;
+	    break;
+
+	case 'c': /* run the library checks instead of the benchmarks */
+	    lib_check = 1;
+	    break;
+
 	case 'h': /* print help message */
 	    usage(argv[0]);
 
@@ -924,10 +2402,13 @@ int main(int argc, char *argv[])
 	convolve_benchmark_count = 1;
 
 	benchmarks_flip[0].tfunct = flip;
+	benchmarks_flip[0].ifunct = NULL;
+	benchmarks_flip[0].rfunct = NULL;
 	benchmarks_flip[0].description = "flip() function";
 	benchmarks_flip[0].valid = 1;
 
 	benchmarks_convolve[0].tfunct = convolve;
+	benchmarks_convolve[0].rfunct = NULL;
 	benchmarks_convolve[0].description = "convolve() function";
 	benchmarks_convolve[0].valid = 1;
     }
@@ -984,6 +2465,13 @@ int main(int argc, char *argv[])
 	    benchmarks_convolve[i].valid = 1;
     }
 
+    /* Map the image buffers, sized for the largest benchmark */
+    alloc_images(images_needed());
+    if (large_dim)
+	printf("Dimension %d is compared against the 2048 baseline\n", large_dim);
+    if (lib_check)
+	exit(run_lib_checks() ? EXIT_FAILURE : EXIT_SUCCESS);
+
     /* Set measurement (fcyc) parameters */
     set_fcyc_cache_size(1 << 14); /* 16 KB cache size */
     set_fcyc_clear_cache(1); /* clear the cache before each measurement */
@@ -999,6 +2487,9 @@ int main(int argc, char *argv[])
 	    test_convolve(i);
     }
 
+    if (formats && !autograder)
+	test_formats();
+
     int flip_points = 5+((flip_maxmean-1.0)*18.75);
     int convolve_points = 5+((convolve_maxmean-1.0)*2.64);
     
@@ -3,7 +3,16 @@
  ********************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
 #include "defs.h"
+#include "kernels.h"
 
 /*
  * Please fill in the following student struct:
@@ -13,6 +22,172 @@ const team_t team = {
     ""                   //Replace this with your partner's email address. Leave blank if working alone.
 };
 
+/***************
+ * PLANAR IMAGES
+ ***************/
+
+/***************************************************************
+ * A planar_image keeps each channel in its own 64-byte aligned
+ * plane of dim*dim unsigned shorts, which vector code can load
+ * directly. Frames can stay planar through several stages and
+ * only pay the pixel <-> planar conversion at the ends.
+ **************************************************************/
+
+/*
+ * planar_alloc - Allocates the three planes of a dim x dim image in
+ *     one block. Returns 0 if memory runs out.
+ */
+int planar_alloc(planar_image *img, int dim)
+{
+    size_t plane = ((size_t)dim * dim * sizeof(unsigned short) + 63) & ~(size_t)63;
+    char *base = aligned_alloc(64, 3 * (plane ? plane : 64));
+
+    img->dim = base ? dim : 0;
+    img->red = (unsigned short *)base;
+    img->green = base ? (unsigned short *)(base + plane) : NULL;
+    img->blue = base ? (unsigned short *)(base + 2 * plane) : NULL;
+    return base != NULL;
+}
+
+void planar_free(planar_image *img)
+{
+    free(img->red);
+    img->red = img->green = img->blue = NULL;
+    img->dim = 0;
+}
+
+/*
+ * Shuffle masks for 8 pixels = 48 bytes = 3 vectors of 8 channel
+ * values. Word w of the interleaved run is channel w%3 of pixel w/3.
+ * deinterleave_mask[c][v] pulls channel c's words out of vector v;
+ * interleave_mask[v][c] places channel c's words into vector v.
+ * Unused bytes are 0x80, which pshufb turns into zeros.
+ */
+static unsigned char deinterleave_mask[3][3][16];
+static unsigned char interleave_mask[3][3][16];
+static int shuffle_masks_built = 0;
+
+static void build_shuffle_masks(void)
+{
+    int w, c, v, p;
+
+    memset(deinterleave_mask, 0x80, sizeof(deinterleave_mask));
+    memset(interleave_mask, 0x80, sizeof(interleave_mask));
+    for (w = 0; w < 24; w++) {
+        c = w % 3;      /* channel */
+        p = w / 3;      /* pixel, i.e. word within the plane vector */
+        v = w / 8;      /* interleaved vector holding the word */
+        deinterleave_mask[c][v][2*p]   = 2 * (w % 8);
+        deinterleave_mask[c][v][2*p+1] = 2 * (w % 8) + 1;
+        interleave_mask[v][c][2*(w % 8)]   = 2 * p;
+        interleave_mask[v][c][2*(w % 8)+1] = 2 * p + 1;
+    }
+    shuffle_masks_built = 1;
+}
+
+#define MASK(m) _mm_loadu_si128((const __m128i *)(m))
+
+__attribute__((target("ssse3")))
+static int deinterleave_ssse3(const unsigned short *s, unsigned short *r, unsigned short *g,
+                              unsigned short *b, int n)
+{
+    int x;
+
+    for (x = 0; x + 8 <= n; x += 8, s += 24) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)s);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(s + 8));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(s + 16));
+        unsigned short *planes[3] = {r + x, g + x, b + x};
+        int c;
+        for (c = 0; c < 3; c++)
+            _mm_storeu_si128((__m128i *)planes[c], _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(v0, MASK(deinterleave_mask[c][0])),
+                             _mm_shuffle_epi8(v1, MASK(deinterleave_mask[c][1]))),
+                _mm_shuffle_epi8(v2, MASK(deinterleave_mask[c][2]))));
+    }
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static int interleave_ssse3(const unsigned short *r, const unsigned short *g,
+                            const unsigned short *b, unsigned short *d, int n)
+{
+    int x;
+
+    for (x = 0; x + 8 <= n; x += 8, d += 24) {
+        __m128i pr = _mm_loadu_si128((const __m128i *)(r + x));
+        __m128i pg = _mm_loadu_si128((const __m128i *)(g + x));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + x));
+        int v;
+        for (v = 0; v < 3; v++)
+            _mm_storeu_si128((__m128i *)(d + 8*v), _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(pr, MASK(interleave_mask[v][0])),
+                             _mm_shuffle_epi8(pg, MASK(interleave_mask[v][1]))),
+                _mm_shuffle_epi8(pb, MASK(interleave_mask[v][2]))));
+    }
+    return x;
+}
+
+/*
+ * pixels_to_planar - Splits a dim x dim pixel image into dst's planes
+ */
+void pixels_to_planar(int dim, const pixel *src, planar_image *dst)
+{
+    int x = 0, n = dim * dim;
+
+    if (__builtin_cpu_supports("ssse3")) {
+        if (!shuffle_masks_built)
+            build_shuffle_masks();
+        x = deinterleave_ssse3((const unsigned short *)src, dst->red, dst->green, dst->blue, n);
+    }
+    for (; x < n; x++) {
+        dst->red[x]   = src[x].red;
+        dst->green[x] = src[x].green;
+        dst->blue[x]  = src[x].blue;
+    }
+}
+
+/*
+ * planar_to_pixels - Merges src's planes back into a pixel image
+ */
+void planar_to_pixels(int dim, const planar_image *src, pixel *dst)
+{
+    int x = 0, n = dim * dim;
+
+    if (__builtin_cpu_supports("ssse3")) {
+        if (!shuffle_masks_built)
+            build_shuffle_masks();
+        x = interleave_ssse3(src->red, src->green, src->blue, (unsigned short *)dst, n);
+    }
+    for (; x < n; x++) {
+        dst[x].red   = src->red[x];
+        dst[x].green = src->green[x];
+        dst[x].blue  = src->blue[x];
+    }
+}
+
+/* Scratch planes for the pixel-in, pixel-out test wrappers */
+static planar_image planar_in, planar_out;
+
+/*
+ * planar_scratch - Makes planar_in and planar_out hold dim x dim
+ *     images. Returns 0 if memory runs out.
+ */
+static int planar_scratch(int dim)
+{
+    if (planar_in.red && planar_in.dim >= dim) {
+        planar_in.dim = planar_out.dim = dim;
+        return 1;
+    }
+    planar_free(&planar_in);
+    planar_free(&planar_out);
+    if (!planar_alloc(&planar_in, dim) || !planar_alloc(&planar_out, dim)) {
+        planar_free(&planar_in);
+        return 0;
+    }
+    return 1;
+}
+
 /***************
  * FLIP KERNEL
  ***************/
@@ -59,129 +234,4878 @@ void flip(int dim, pixel *src, pixel *dst)
     }
 }
 
-/*********************************************************************
- * register_flip_functions - Register all of your different versions
- *     of the flip kernel with the driver by calling the
- *     add_flip_function() for each test function. When you run the
- *     driver program, it will test and report the performance of each
- *     registered test function.  
- *********************************************************************/
+/*
+ * flip_affine - Every mapping the driver hands out through RIDX_F is
+ *     affine in (i, j), so three probes give the start offset and the
+ *     per-row and per-column steps. Flip loops can then walk dst with
+ *     adds instead of an indirect call per pixel.
+ */
+static void flip_affine(int dim, long *o, long *di, long *dj)
+{
+    *o = RIDX_F(0, 0, dim);
+    *di = RIDX_F(1, 0, dim) - *o;
+    *dj = RIDX_F(0, 1, dim) - *o;
+}
 
-void register_flip_functions() 
+/* Largest block, in pixels, the recursive flip copies directly: its
+   src and dst footprints (6 KB each) fit in L1 together */
+#define FLIP_LEAF_AREA 1024
+
+/*
+ * recursive_flip_block - Flips rows [i0, i1) x columns [j0, j1) of src,
+ *     halving the longer side until the block fits FLIP_LEAF_AREA.
+ *     The split never looks at the cache size beyond the leaf, so each
+ *     level of the recursion fits some level of the hierarchy.
+ */
+static void recursive_flip_block(int dim, const pixel *src, pixel *dst,
+                                 long o, long di, long dj, int i0, int i1, int j0, int j1)
 {
-    add_flip_function(&flip, flip_descr);   
-    //add_flip_function(&naive_flip, naive_flip_descr);   
-    /* ... Register additional test functions here */
+    int i, j;
+
+    if ((i1 - i0) * (j1 - j0) <= FLIP_LEAF_AREA) {
+        for (i = i0; i < i1; i++) {
+            const pixel *s = &src[RIDX(i, 0, dim)];
+            pixel *d = dst + o + i * di;
+            for (j = j0; j < j1; j++)
+                d[j * dj] = s[j];
+        }
+        return;
+    }
+    if (i1 - i0 >= j1 - j0) {
+        recursive_flip_block(dim, src, dst, o, di, dj, i0, (i0 + i1) / 2, j0, j1);
+        recursive_flip_block(dim, src, dst, o, di, dj, (i0 + i1) / 2, i1, j0, j1);
+    }
+    else {
+        recursive_flip_block(dim, src, dst, o, di, dj, i0, i1, j0, (j0 + j1) / 2);
+        recursive_flip_block(dim, src, dst, o, di, dj, i0, i1, (j0 + j1) / 2, j1);
+    }
 }
 
+/*
+ * recursive_flip - Cache-oblivious flip for any RIDX_F mapping
+ */
+char recursive_flip_descr[] = "recursive_flip: Cache-oblivious divide and conquer, any mapping";
+void recursive_flip(int dim, pixel *src, pixel *dst)
+{
+    long o, di, dj;
 
-/***************
- * CONVOLVE KERNEL
- **************/
- 
-/***************************************************************
- * Various typedefs and helper functions for the convolve function
- * You may modify these any way you like.
- **************************************************************/
+    flip_affine(dim, &o, &di, &dj);
+    recursive_flip_block(dim, src, dst, o, di, dj, 0, dim, 0, dim);
+}
 
-/* A struct used to compute a pixel value */
-typedef struct {
-    float red;
-    float green;
-    float blue;
-    float weight;
-} pixel_sum;
+/*
+ * Transposing flips (transpose, both rotates, reflect_both) in 8x8
+ * pixel blocks held in registers. Each row of a block is 48 bytes,
+ * which the pixel shuffle masks split into an 8-word vector per
+ * channel; each channel's 8x8 word matrix is transposed with three
+ * rounds of unpacks, and the columns are re-interleaved and stored
+ * as dst rows. A mapping that runs dst rows backwards (di = -1)
+ * reverses the words before the store.
+ */
 
-/******************************************************
- * Your different versions of the convolve kernel go here
- ******************************************************/
+#define FLIP_BLOCK_TILE 64  /* block-walk tile, pixels per side */
 
 /*
- * naive_convolve - The naive baseline version of convolve 
+ * transpose8_epi16 - Transposes the 8x8 word matrix m[0..7] in place
  */
-char naive_convolve_descr[] = "naive_convolve: Naive baseline implementation";
-void naive_convolve(int dim, pixel *src, pixel *dst) 
+__attribute__((target("ssse3")))
+static inline void transpose8_epi16(__m128i *m)
 {
-    int i, j, ii, jj, curI, curJ;
-    pixel_sum ps;
-    
-    for (j = 0; j < dim; j++){
-        for (i = 0; i < dim; i++){
-            ps.red    = 0.0;
-            ps.green  = 0.0;
-            ps.blue   = 0.0;
-            ps.weight = 0.0;
-            for (jj = -2; jj <= 2; jj++){
-                for (ii = -2; ii <= 2; ii++){
-                    curJ = j+jj;
-                    if(curJ<0 || curJ>=dim){
-                        continue;	
-                    }
-                    curI = i+ii;
-                    if(curI<0 || curI>=dim){
-                        continue;
-                    }
-                    ps.red   += src[RIDX(curI, curJ, dim)].red *   kernel[ii+2][jj+2];
-                    ps.green += src[RIDX(curI, curJ, dim)].green * kernel[ii+2][jj+2];
-                    ps.blue  += src[RIDX(curI, curJ, dim)].blue *  kernel[ii+2][jj+2];
-                    ps.weight += kernel[ii+2][jj+2];
-                }
+    __m128i a0 = _mm_unpacklo_epi16(m[0], m[1]), a1 = _mm_unpackhi_epi16(m[0], m[1]);
+    __m128i a2 = _mm_unpacklo_epi16(m[2], m[3]), a3 = _mm_unpackhi_epi16(m[2], m[3]);
+    __m128i a4 = _mm_unpacklo_epi16(m[4], m[5]), a5 = _mm_unpackhi_epi16(m[4], m[5]);
+    __m128i a6 = _mm_unpacklo_epi16(m[6], m[7]), a7 = _mm_unpackhi_epi16(m[6], m[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+
+    m[0] = _mm_unpacklo_epi64(b0, b4);
+    m[1] = _mm_unpackhi_epi64(b0, b4);
+    m[2] = _mm_unpacklo_epi64(b1, b5);
+    m[3] = _mm_unpackhi_epi64(b1, b5);
+    m[4] = _mm_unpacklo_epi64(b2, b6);
+    m[5] = _mm_unpackhi_epi64(b2, b6);
+    m[6] = _mm_unpacklo_epi64(b3, b7);
+    m[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/*
+ * flip_block8_ssse3 - Flips the 8x8 block whose top-left src pixel is
+ *     s. Column k of the block goes to the 8 pixels starting at
+ *     d + k*dj, in reverse order if reverse is set. With nt set the
+ *     stores are non-temporal and d + k*dj must be 16-byte aligned.
+ */
+__attribute__((target("ssse3")))
+static void flip_block8_ssse3(const pixel *s, int dim, pixel *d, long dj, int reverse, int nt)
+{
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    __m128i ch[3][8];
+    int r, c, v;
+
+    for (r = 0; r < 8; r++) {
+        const __m128i *p = (const __m128i *)&s[r * dim];
+        __m128i v0 = _mm_loadu_si128(p), v1 = _mm_loadu_si128(p + 1);
+        __m128i v2 = _mm_loadu_si128(p + 2);
+        for (c = 0; c < 3; c++)
+            ch[c][r] = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(v0, MASK(deinterleave_mask[c][0])),
+                             _mm_shuffle_epi8(v1, MASK(deinterleave_mask[c][1]))),
+                _mm_shuffle_epi8(v2, MASK(deinterleave_mask[c][2])));
+    }
+    for (c = 0; c < 3; c++) {
+        transpose8_epi16(ch[c]);
+        if (reverse)
+            for (r = 0; r < 8; r++)
+                ch[c][r] = _mm_shuffle_epi8(ch[c][r], rev);
+    }
+    for (r = 0; r < 8; r++) {
+        __m128i *p = (__m128i *)(d + r * dj);
+        for (v = 0; v < 3; v++) {
+            __m128i x = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(ch[0][r], MASK(interleave_mask[v][0])),
+                             _mm_shuffle_epi8(ch[1][r], MASK(interleave_mask[v][1]))),
+                _mm_shuffle_epi8(ch[2][r], MASK(interleave_mask[v][2])));
+            if (nt)
+                _mm_stream_si128(p + v, x);
+            else
+                _mm_storeu_si128(p + v, x);
+        }
+    }
+}
+
+/*
+ * block_flip - 8x8 register blocks for the transposing mappings,
+ *     walked in FLIP_BLOCK_TILE tiles; the ragged right and bottom
+ *     edges and the mirror mappings go through recursive_flip()
+ */
+char block_flip_descr[] = "block_flip: 8x8 in-register transposes for rotate/transpose";
+void block_flip(int dim, pixel *src, pixel *dst)
+{
+    long o, di, dj;
+    int n8 = dim & ~7, ti, tj, i, j, iend, jend;
+
+    flip_affine(dim, &o, &di, &dj);
+    if (dim < 8 || (di != 1 && di != -1) || !__builtin_cpu_supports("ssse3")) {
+        recursive_flip(dim, src, dst);
+        return;
+    }
+    if (!shuffle_masks_built)
+        build_shuffle_masks();
+
+    for (ti = 0; ti < n8; ti += FLIP_BLOCK_TILE) {
+        iend = ti + FLIP_BLOCK_TILE < n8 ? ti + FLIP_BLOCK_TILE : n8;
+        for (tj = 0; tj < n8; tj += FLIP_BLOCK_TILE) {
+            jend = tj + FLIP_BLOCK_TILE < n8 ? tj + FLIP_BLOCK_TILE : n8;
+            for (i = ti; i < iend; i += 8)
+                for (j = tj; j < jend; j += 8)
+                    flip_block8_ssse3(&src[RIDX(i, j, dim)], dim,
+                                      dst + o + j * dj + (di > 0 ? i : i + 7) * di,
+                                      dj, di < 0, 0);
+        }
+    }
+    if (n8 < dim) {
+        recursive_flip_block(dim, src, dst, o, di, dj, 0, dim, n8, dim);
+        recursive_flip_block(dim, src, dst, o, di, dj, n8, dim, 0, n8);
+    }
+}
+
+/*
+ * Streaming flip. Once src and dst together outgrow the last-level
+ * cache, every ordinary dst store first reads in a line it is about
+ * to overwrite completely. Non-temporal stores skip that read, which
+ * is a third of the flip's memory traffic. They need 16-byte aligned
+ * targets, which every STREAM_RUN-pixel dst run has when dim is a
+ * multiple of STREAM_RUN and dst is aligned.
+ */
+
+#define STREAM_RUN 32    /* pixels per streamed dst run: 192 bytes */
+
+static long llc_bytes = 0;
+
+/*
+ * get_llc_bytes - Size of the last-level cache; PERFLAB_LLC_BYTES
+ *     overrides what the system reports
+ */
+static long get_llc_bytes(void)
+{
+    char *env;
+
+    if (llc_bytes)
+        return llc_bytes;
+    env = getenv("PERFLAB_LLC_BYTES");
+    if (env && atol(env) > 0)
+        llc_bytes = atol(env);
+    else {
+#ifdef _SC_LEVEL3_CACHE_SIZE
+        llc_bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        if (llc_bytes <= 0)
+            llc_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        if (llc_bytes <= 0)
+            llc_bytes = 8L << 20;
+    }
+    return llc_bytes;
+}
+
+/*
+ * stream_mirror_rows - Mirrors (dst rows forward or backward) with
+ *     non-temporal stores, 8 pixels at a time
+ */
+__attribute__((target("ssse3")))
+static void stream_mirror_rows(int dim, const pixel *src, pixel *dst, long o, long di, long dj)
+{
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    int i, j, c, v;
+
+    for (i = 0; i < dim; i++) {
+        const pixel *s = &src[RIDX(i, 0, dim)];
+        pixel *d = dst + o + i * di;
+        for (j = 0; j < dim; j += 8) {
+            const __m128i *p = (const __m128i *)&s[j];
+            __m128i v0 = _mm_loadu_si128(p), v1 = _mm_loadu_si128(p + 1);
+            __m128i v2 = _mm_loadu_si128(p + 2);
+            __m128i *q = (__m128i *)(d + (dj > 0 ? j : j + 7) * dj);
+            __m128i ch[3];
+            if (dj > 0) {
+                _mm_stream_si128(q, v0);
+                _mm_stream_si128(q + 1, v1);
+                _mm_stream_si128(q + 2, v2);
+                continue;
             }
-            dst[RIDX(i,j,dim)].red   = (unsigned short)(ps.red/ps.weight);
-            dst[RIDX(i,j,dim)].green = (unsigned short)(ps.green/ps.weight);
-            dst[RIDX(i,j,dim)].blue  = (unsigned short)(ps.blue/ps.weight);
+            for (c = 0; c < 3; c++)
+                ch[c] = _mm_shuffle_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(v0, MASK(deinterleave_mask[c][0])),
+                                 _mm_shuffle_epi8(v1, MASK(deinterleave_mask[c][1]))),
+                    _mm_shuffle_epi8(v2, MASK(deinterleave_mask[c][2]))), rev);
+            for (v = 0; v < 3; v++)
+                _mm_stream_si128(q + v, _mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(ch[0], MASK(interleave_mask[v][0])),
+                                 _mm_shuffle_epi8(ch[1], MASK(interleave_mask[v][1]))),
+                    _mm_shuffle_epi8(ch[2], MASK(interleave_mask[v][2]))));
         }
     }
 }
 
 /*
- * convolve - Your current working version of convolve. 
- * IMPORTANT: This is the version you will be graded on
+ * stream_flip - Non-temporal flip for images whose src + dst exceed
+ *     the LLC; smaller or unaligned images go through block_flip().
+ *     Transposing mappings gather STREAM_RUN-pixel dst runs (three
+ *     whole cache lines) from 8x8 blocks in an L1 staging area first,
+ *     since scattered partial-line streaming stores defeat the
+ *     write-combining buffers.
  */
-char convolve_descr[] = "convolve: Current working version";
-void convolve(int dim, pixel *src, pixel *dst) 
+char stream_flip_descr[] = "stream_flip: Non-temporal dst stores above the LLC size";
+void stream_flip(int dim, pixel *src, pixel *dst)
 {
-    int i, j, ii, jj, curI, curJ;
-    pixel_sum ps;
-    
-    for (i = 0; i < dim; i++)
-    {
-        for (j = 0; j < dim; j++)
-        {
-        //possible "blocking" could be used here for larger outer loops increments to iterate over?
-            ps.red    = 0.0;
-            ps.green  = 0.0;
-            ps.blue   = 0.0;
-            ps.weight = 0.0;
-            for (jj = -2; jj <= 2; jj++)
-            {
-            	curJ = j+jj;
-            	if(curJ<0 || curJ>=dim)
-            	{
-                        continue;	
-                }
-                for (ii = -2; ii <= 2; ii++)
-                {
-                    
-                    curI = i+ii;
-                    if(curI<0 || curI>=dim)
-                    {
-                        continue;
-                    }
-                    ps.red   += src[RIDX(curI, curJ, dim)].red *   kernel[ii+2][jj+2];
-                    ps.green += src[RIDX(curI, curJ, dim)].green * kernel[ii+2][jj+2];
-                    ps.blue  += src[RIDX(curI, curJ, dim)].blue *  kernel[ii+2][jj+2];
-                    ps.weight += kernel[ii+2][jj+2];
+    pixel stage[8][STREAM_RUN] __attribute__((aligned(64)));
+    long o, di, dj;
+    int i0, i, j, r, v;
+
+    if (2L * dim * dim * sizeof(pixel) <= get_llc_bytes() || dim % STREAM_RUN ||
+        (unsigned long)dst % 16 || !__builtin_cpu_supports("ssse3")) {
+        block_flip(dim, src, dst);
+        return;
+    }
+    if (!shuffle_masks_built)
+        build_shuffle_masks();
+
+    flip_affine(dim, &o, &di, &dj);
+    if (di == 1 || di == -1) {
+        for (i0 = 0; i0 < dim; i0 += STREAM_RUN) {
+            for (j = 0; j < dim; j += 8) {
+                for (i = i0; i < i0 + STREAM_RUN; i += 8)
+                    flip_block8_ssse3(&src[RIDX(i, j, dim)], dim,
+                                      &stage[0][di > 0 ? i - i0 : STREAM_RUN - 8 - (i - i0)],
+                                      STREAM_RUN, di < 0, 0);
+                for (r = 0; r < 8; r++) {
+                    const __m128i *p = (const __m128i *)stage[r];
+                    __m128i *q = (__m128i *)(dst + o + (j + r) * dj +
+                                             (di > 0 ? i0 : i0 + STREAM_RUN - 1) * di);
+                    for (v = 0; v < STREAM_RUN * 6 / 16; v++)
+                        _mm_stream_si128(q + v, _mm_load_si128(p + v));
                 }
             }
-            dst[RIDX(i,j,dim)].red   = (unsigned short)(ps.red/ps.weight);
-            dst[RIDX(i,j,dim)].green = (unsigned short)(ps.green/ps.weight);
-            dst[RIDX(i,j,dim)].blue  = (unsigned short)(ps.blue/ps.weight);
         }
     }
+    else
+        stream_mirror_rows(dim, src, dst, o, di, dj);
+    _mm_sfence();
+}
+
+/*
+ * Specialized flips. Each RIDX_F mapping gets its own kernel with
+ * the index arithmetic written out, so the inner loops have no
+ * indirect calls and no per-pixel branches. Mirrors keep dst rows
+ * contiguous and walk row-major; the transposing mappings walk src
+ * in SPEC_FLIP_TILE tiles. The kernel is picked once per RIDX_F
+ * (the driver sets RIDX_F after registering our functions, so the
+ * choice is made on the first call).
+ */
+
+#define SPEC_FLIP_TILE 32
+
+#define MAP_MIRROR_VERTICAL(i, j, n)    RIDX(i, (n) - 1 - (j), n)
+#define MAP_MIRROR_HORIZONTAL(i, j, n)  RIDX((n) - 1 - (i), j, n)
+#define MAP_MIRROR_BOTH(i, j, n)        RIDX((n) - 1 - (i), (n) - 1 - (j), n)
+#define MAP_ROTATE_CW(i, j, n)          RIDX(j, (n) - 1 - (i), n)
+#define MAP_ROTATE_ACW(i, j, n)         RIDX((n) - 1 - (j), i, n)
+#define MAP_TRANSPOSE(i, j, n)          RIDX(j, i, n)
+#define MAP_REFLECT_BOTH(i, j, n)       RIDX((n) - 1 - (j), (n) - 1 - (i), n)
+
+#define DEFINE_ROW_FLIP(name, MAP)                                      \
+static void spec_flip_##name(int dim, pixel *src, pixel *dst)           \
+{                                                                       \
+    int i, j;                                                           \
+                                                                        \
+    for (i = 0; i < dim; i++) {                                         \
+        const pixel *s = &src[RIDX(i, 0, dim)];                         \
+        for (j = 0; j < dim; j++)                                       \
+            dst[MAP(i, j, dim)] = s[j];                                 \
+    }                                                                   \
+}
+
+#define DEFINE_TILED_FLIP(name, MAP)                                    \
+static void spec_flip_##name(int dim, pixel *src, pixel *dst)           \
+{                                                                       \
+    int ti, tj, i, j, iend, jend;                                       \
+                                                                        \
+    for (ti = 0; ti < dim; ti += SPEC_FLIP_TILE) {                      \
+        iend = ti + SPEC_FLIP_TILE < dim ? ti + SPEC_FLIP_TILE : dim;   \
+        for (tj = 0; tj < dim; tj += SPEC_FLIP_TILE) {                  \
+            jend = tj + SPEC_FLIP_TILE < dim ? tj + SPEC_FLIP_TILE : dim; \
+            for (i = ti; i < iend; i++)                                 \
+                for (j = tj; j < jend; j++)                             \
+                    dst[MAP(i, j, dim)] = src[RIDX(i, j, dim)];         \
+        }                                                               \
+    }                                                                   \
+}
+
+DEFINE_ROW_FLIP(mirror_vertical, MAP_MIRROR_VERTICAL)
+DEFINE_ROW_FLIP(mirror_horizontal, MAP_MIRROR_HORIZONTAL)
+DEFINE_ROW_FLIP(mirror_both, MAP_MIRROR_BOTH)
+DEFINE_TILED_FLIP(rotate_cw, MAP_ROTATE_CW)
+DEFINE_TILED_FLIP(rotate_acw, MAP_ROTATE_ACW)
+DEFINE_TILED_FLIP(transpose, MAP_TRANSPOSE)
+DEFINE_TILED_FLIP(reflect_both, MAP_REFLECT_BOTH)
+
+/*
+ * spec_flip_identity - The identity transform, for views and chains
+ *     that need a kernel for every element of the group
+ */
+static void spec_flip_identity(int dim, pixel *src, pixel *dst)
+{
+    if (dst != src)
+        memcpy(dst, src, (size_t)dim * dim * sizeof(pixel));
+}
+
+/* Kernels indexed by flip_transform */
+static const lab_test_func spec_flips[8] = {
+    spec_flip_identity,
+    spec_flip_mirror_vertical,
+    spec_flip_mirror_horizontal,
+    spec_flip_mirror_both,
+    spec_flip_transpose,
+    spec_flip_rotate_cw,
+    spec_flip_rotate_acw,
+    spec_flip_reflect_both,
+};
+
+/*
+ * transform_affine_rect - Offset and steps of transform t for a
+ *     width x height source whose dst rows are stride pixels apart.
+ *     The swapping transforms make dst height x width.
+ */
+static void transform_affine_rect(int t, int width, int height, int stride,
+                                  long *o, long *di, long *dj)
+{
+    int dst_rows = (t & FLIP_SWAP) ? width : height;
+    int dst_cols = (t & FLIP_SWAP) ? height : width;
+    long rows = (t & FLIP_ROWS_REV) ? -(long)stride : stride;
+    long cols = (t & FLIP_COLS_REV) ? -1 : 1;
+
+    *o = ((t & FLIP_ROWS_REV) ? (long)(dst_rows - 1) * stride : 0) +
+        ((t & FLIP_COLS_REV) ? dst_cols - 1 : 0);
+    *di = (t & FLIP_SWAP) ? cols : rows;
+    *dj = (t & FLIP_SWAP) ? rows : cols;
+}
+
+/*
+ * transform_affine - Offset and steps of transform t at size n, in
+ *     the same form as flip_affine(): (i, j) goes to o + i*di + j*dj
+ */
+static void transform_affine(int t, int n, long *o, long *di, long *dj)
+{
+    transform_affine_rect(t, n, n, n, o, di, dj);
+}
+
+/* Probe size for telling the mappings apart by their affine steps */
+#define SPEC_FLIP_PROBE 16
+
+/*
+ * current_flip_transform - Which transform RIDX_F is, read off its
+ *     affine steps; -1 if it is none of the eight
+ */
+int current_flip_transform(void)
+{
+    long o, di, dj, to, tdi, tdj;
+    int t;
+
+    flip_affine(SPEC_FLIP_PROBE, &o, &di, &dj);
+    for (t = 0; t < 8; t++) {
+        transform_affine(t, SPEC_FLIP_PROBE, &to, &tdi, &tdj);
+        if (o == to && di == tdi && dj == tdj)
+            return t;
+    }
+    return -1;
 }
 
-/********************************************************************* 
+static FlippedFunc spec_flip_for = NULL;
+static lab_test_func spec_flip_func = NULL;
+
+/*
+ * select_spec_flip - The kernel for the current RIDX_F, looked up
+ *     only when RIDX_F changes; naive_flip() if no kernel matches
+ */
+static lab_test_func select_spec_flip(void)
+{
+    int t;
+
+    if (spec_flip_func && spec_flip_for == RIDX_F)
+        return spec_flip_func;
+    t = current_flip_transform();
+    spec_flip_func = t < 0 ? naive_flip : spec_flips[t];
+    spec_flip_for = RIDX_F;
+    return spec_flip_func;
+}
+
+/*
+ * spec_flip - Runs the specialized kernel for the current mapping
+ */
+char spec_flip_descr[] = "spec_flip: Per-mapping inlined kernel, selected once";
+void spec_flip(int dim, pixel *src, pixel *dst)
+{
+    select_spec_flip()(dim, src, dst);
+}
+
+/*
+ * Flipped views. A view reads the flipped image straight out of the
+ * unflipped one, so a consumer that reads it once never pays for
+ * writing dst. Rows are handed out in tiles; a consumer that needs
+ * random access gets a materialized copy instead.
+ */
+
+#define VIEW_TILE 16     /* view columns gathered per pass over a band */
+
+/*
+ * transform_inverse - The transform that undoes t. Only the swapping
+ *     transforms are not their own inverse: undoing one exchanges the
+ *     row and column reversals.
+ */
+static int transform_inverse(int t)
+{
+    if (!(t & FLIP_SWAP))
+        return t;
+    return FLIP_SWAP | ((t & FLIP_ROWS_REV) ? FLIP_COLS_REV : 0) |
+        ((t & FLIP_COLS_REV) ? FLIP_ROWS_REV : 0);
+}
+
+/*
+ * flip_view_init - v becomes src (dim x dim) flipped by t. Nothing is
+ *     copied.
+ */
+void flip_view_init(flip_view *v, flip_transform t, int dim, pixel *src)
+{
+    v->src = src;
+    v->dim = dim;
+    v->t = t;
+    v->copy = NULL;
+    /* dst(i, j) = src(F^-1(i, j)), so the view walks the inverse map */
+    transform_affine(transform_inverse(t), dim, &v->o, &v->di, &v->dj);
+}
+
+/*
+ * flip_view_release - Frees the materialized copy, if one was made
+ */
+void flip_view_release(flip_view *v)
+{
+    free(v->copy);
+    v->copy = NULL;
+}
+
+/*
+ * flip_view_rows - Copies view rows [r0, r0+n) into out, row-major.
+ *     For the swapping transforms a view row is a src column, so the
+ *     band is gathered VIEW_TILE columns at a time: each src row then
+ *     gives a short contiguous run instead of one pixel.
+ */
+void flip_view_rows(const flip_view *v, int r0, int n, pixel *out)
+{
+    int dim = v->dim;
+    int r, c, c0, cend;
+
+    if (!(v->t & FLIP_SWAP)) {
+        for (r = 0; r < n; r++) {
+            const pixel *s = &FLIP_VIEW_AT(v, r0 + r, 0);
+            pixel *d = &out[RIDX(r, 0, dim)];
+            if (v->dj == 1)
+                memcpy(d, s, dim * sizeof(pixel));
+            else
+                for (c = 0; c < dim; c++)
+                    d[c] = s[-c];
+        }
+        return;
+    }
+    for (c0 = 0; c0 < dim; c0 += VIEW_TILE) {
+        cend = c0 + VIEW_TILE < dim ? c0 + VIEW_TILE : dim;
+        for (c = c0; c < cend; c++) {
+            const pixel *s = &FLIP_VIEW_AT(v, r0, c);
+            for (r = 0; r < n; r++)
+                out[RIDX(r, c, dim)] = s[r * v->di];
+        }
+    }
+}
+
+/*
+ * flip_view_materialize - Writes the whole view into dst in a single
+ *     pass of the transform's specialized kernel
+ */
+void flip_view_materialize(const flip_view *v, pixel *dst)
+{
+    if (v->copy)
+        memcpy(dst, v->copy, (size_t)v->dim * v->dim * sizeof(pixel));
+    else
+        spec_flips[v->t](v->dim, v->src, dst);
+}
+
+/*
+ * flip_view_pixels - The view as a plain image, for consumers that
+ *     read it in no particular order. The identity needs no copy; any
+ *     other transform is materialized on the first call and kept until
+ *     flip_view_release(). Returns NULL if memory runs out.
+ */
+pixel *flip_view_pixels(flip_view *v)
+{
+    if (v->t == FLIP_IDENTITY)
+        return v->src;
+    if (!v->copy) {
+        v->copy = aligned_alloc(64, ((size_t)v->dim * v->dim * sizeof(pixel) + 63) & ~(size_t)63);
+        if (v->copy)
+            spec_flips[v->t](v->dim, v->src, v->copy);
+    }
+    return v->copy;
+}
+
+/* View rows staged per call of flip_view_rows() by view_flip() */
+#define VIEW_BAND 16
+
+/*
+ * view_flip - Reads the current mapping's view band by band. Mostly
+ *     a check that the views agree with RIDX_F.
+ */
+char view_flip_descr[] = "view_flip: Flipped view read out in tiled bands";
+void view_flip(int dim, pixel *src, pixel *dst)
+{
+    int t = current_flip_transform();
+    flip_view v;
+    int r;
+
+    if (t < 0) {
+        naive_flip(dim, src, dst);
+        return;
+    }
+    flip_view_init(&v, t, dim, src);
+    for (r = 0; r < dim; r += VIEW_BAND)
+        flip_view_rows(&v, r, dim - r < VIEW_BAND ? dim - r : VIEW_BAND, &dst[RIDX(r, 0, dim)]);
+}
+
+/*
+ * In-place flips. Every mapping except the rotates is its own
+ * inverse, so the image splits into pixel pairs {p, F(p)} that just
+ * trade places; the rotates split into 4-cycles. Both walks go in
+ * INPLACE_TILE square tiles, so the (at most four) tiles a step
+ * touches stay cached together.
+ */
+
+#define INPLACE_TILE 32
+
+/*
+ * inplace_swap_pairs - Swaps every pixel with its image under an
+ *     involution; each pair is swapped from its lower index
+ */
+static void inplace_swap_pairs(int dim, pixel *img, long o, long di, long dj)
+{
+    int ti, tj, i, j, iend, jend;
+    long p, q;
+    pixel t;
+
+    for (ti = 0; ti < dim; ti += INPLACE_TILE) {
+        iend = ti + INPLACE_TILE < dim ? ti + INPLACE_TILE : dim;
+        for (tj = 0; tj < dim; tj += INPLACE_TILE) {
+            jend = tj + INPLACE_TILE < dim ? tj + INPLACE_TILE : dim;
+            for (i = ti; i < iend; i++) {
+                for (j = tj; j < jend; j++) {
+                    p = RIDX(i, j, dim);
+                    q = o + i * di + j * dj;
+                    if (p < q) {
+                        t = img[p];
+                        img[p] = img[q];
+                        img[q] = t;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * inplace_rotate - Rotates by a quarter turn, clockwise if cw is set,
+ *     moving each 4-cycle of the top-left quadrant in one step
+ */
+static void inplace_rotate(int dim, pixel *img, int cw)
+{
+    int ti, tj, i, j, iend, jend, n = dim - 1;
+    int ilim = dim / 2, jlim = (dim + 1) / 2;
+    pixel *p0, *p1, *p2, *p3, t;
+
+    for (ti = 0; ti < ilim; ti += INPLACE_TILE) {
+        iend = ti + INPLACE_TILE < ilim ? ti + INPLACE_TILE : ilim;
+        for (tj = 0; tj < jlim; tj += INPLACE_TILE) {
+            jend = tj + INPLACE_TILE < jlim ? tj + INPLACE_TILE : jlim;
+            for (i = ti; i < iend; i++) {
+                for (j = tj; j < jend; j++) {
+                    /* the value at p0 moves to p1, p1's to p2, ... */
+                    p0 = &img[RIDX(i, j, dim)];
+                    p2 = &img[RIDX(n - i, n - j, dim)];
+                    p1 = cw ? &img[RIDX(j, n - i, dim)] : &img[RIDX(n - j, i, dim)];
+                    p3 = cw ? &img[RIDX(n - j, i, dim)] : &img[RIDX(j, n - i, dim)];
+                    t = *p3;
+                    *p3 = *p2;
+                    *p2 = *p1;
+                    *p1 = *p0;
+                    *p0 = t;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * inplace_affine - Applies the flip with offset o and steps di, dj
+ *     (see flip_affine()) to img where it stands
+ */
+static void inplace_affine(int dim, pixel *img, long o, long di, long dj)
+{
+    if (dim < 2 || (di == dim && dj == 1))
+        return;
+    if (di == -1 && dj == dim)
+        inplace_rotate(dim, img, 1);
+    else if (di == 1 && dj == -dim)
+        inplace_rotate(dim, img, 0);
+    else
+        inplace_swap_pairs(dim, img, o, di, dj);
+}
+
+/*
+ * inplace_flip - Applies the current flip to img where it stands,
+ *     without a second image buffer
+ */
+char inplace_flip_descr[] = "inplace_flip: Single buffer, tiled pair swaps and 4-cycles";
+void inplace_flip(int dim, pixel *img)
+{
+    long o, di, dj;
+
+    flip_affine(dim, &o, &di, &dj);
+    inplace_affine(dim, img, o, di, dj);
+}
+
+/*
+ * Transform chains. Applying s then t is again one of the eight
+ * transforms, so a chain of any length is multiplied out on the
+ * descriptors and costs a single pass; a chain that cancels to the
+ * identity costs nothing at all in place.
+ */
+
+/*
+ * flip_compose - The transform that applies first, then second. The
+ *     swaps cancel in pairs; when second swaps, first's row reversal
+ *     ends up on the columns and vice versa.
+ */
+flip_transform flip_compose(flip_transform first, flip_transform second)
+{
+    int swap = (first ^ second) & FLIP_SWAP;
+    int rows = (second & FLIP_SWAP) ? (first & FLIP_COLS_REV) << 1 : first & FLIP_ROWS_REV;
+    int cols = (second & FLIP_SWAP) ? (first & FLIP_ROWS_REV) >> 1 : first & FLIP_COLS_REV;
+
+    return swap | ((rows | cols) ^ (second & (FLIP_ROWS_REV | FLIP_COLS_REV)));
+}
+
+/*
+ * flip_compose_chain - chain[0] applied first, chain[n-1] last, as
+ *     one transform
+ */
+flip_transform flip_compose_chain(const flip_transform *chain, int n)
+{
+    flip_transform t = FLIP_IDENTITY;
+    int k;
+
+    for (k = 0; k < n; k++)
+        t = flip_compose(t, chain[k]);
+    return t;
+}
+
+/*
+ * flip_chain - dst = src run through chain[0..n) in a single pass.
+ *     src and dst may be the same image, in which case the pass is
+ *     made in place and an identity chain does nothing.
+ */
+void flip_chain(int dim, const flip_transform *chain, int n, pixel *src, pixel *dst)
+{
+    flip_transform t = flip_compose_chain(chain, n);
+    long o, di, dj;
+
+    if (src == dst) {
+        transform_affine(t, dim, &o, &di, &dj);
+        inplace_affine(dim, dst, o, di, dj);
+    } else {
+        spec_flips[t](dim, src, dst);
+    }
+}
+
+/*
+ * flip_view_apply - Flips the view v once more by t, still without
+ *     touching any pixels. A materialized copy is dropped.
+ */
+void flip_view_apply(flip_view *v, flip_transform t)
+{
+    flip_view_release(v);
+    flip_view_init(v, flip_compose(v->t, t), v->dim, v->src);
+}
+
+/*
+ * chain_flip - The current mapping spelled out as its chain of
+ *     generators (transpose, mirror horizontally, mirror vertically)
+ *     and collapsed back into one pass
+ */
+char chain_flip_descr[] = "chain_flip: Generator chain collapsed to one pass";
+void chain_flip(int dim, pixel *src, pixel *dst)
+{
+    flip_transform chain[3];
+    int t = current_flip_transform();
+    int n = 0;
+
+    if (t < 0) {
+        naive_flip(dim, src, dst);
+        return;
+    }
+    if (t & FLIP_SWAP)
+        chain[n++] = FLIP_TRANSPOSE;
+    if (t & FLIP_ROWS_REV)
+        chain[n++] = FLIP_MIRROR_HORIZONTAL;
+    if (t & FLIP_COLS_REV)
+        chain[n++] = FLIP_MIRROR_VERTICAL;
+    flip_chain(dim, chain, n, src, dst);
+}
+
+/*
+ * Rectangular flips. The source is width x height with rows
+ * src_stride pixels apart; the swapping transforms write a height x
+ * width dst. Mirrors go row by row, the others in SPEC_FLIP_TILE
+ * tiles, as in the square kernels.
+ */
+
+/*
+ * flip_rect_transform - dst = src flipped by t
+ */
+void flip_rect_transform(flip_transform t, int width, int height, pixel *src,
+                         int src_stride, pixel *dst, int dst_stride)
+{
+    long o, di, dj;
+    int ti, tj, i, j, iend, jend;
+
+    transform_affine_rect(t, width, height, dst_stride, &o, &di, &dj);
+    if (!(t & FLIP_SWAP)) {
+        for (i = 0; i < height; i++) {
+            const pixel *s = &src[RIDX(i, 0, src_stride)];
+            pixel *d = &dst[o + i * di];
+            if (dj == 1)
+                memcpy(d, s, width * sizeof(pixel));
+            else
+                for (j = 0; j < width; j++)
+                    d[-j] = s[j];
+        }
+        return;
+    }
+    for (ti = 0; ti < height; ti += SPEC_FLIP_TILE) {
+        iend = ti + SPEC_FLIP_TILE < height ? ti + SPEC_FLIP_TILE : height;
+        for (tj = 0; tj < width; tj += SPEC_FLIP_TILE) {
+            jend = tj + SPEC_FLIP_TILE < width ? tj + SPEC_FLIP_TILE : width;
+            for (i = ti; i < iend; i++) {
+                const pixel *s = &src[RIDX(i, 0, src_stride)];
+                pixel *d = &dst[o + i * di];
+                for (j = tj; j < jend; j++)
+                    d[j * dj] = s[j];
+            }
+        }
+    }
+}
+
+/*
+ * flip_rect - The current mapping applied to a rectangular image
+ */
+char flip_rect_descr[] = "flip_rect: Rectangular, strided rows";
+void flip_rect(int width, int height, pixel *src, int src_stride, pixel *dst, int dst_stride)
+{
+    int t = current_flip_transform();
+
+    flip_rect_transform(t < 0 ? FLIP_IDENTITY : t, width, height,
+                        src, src_stride, dst, dst_stride);
+}
+
+#define PLANE_TILE 64
+
+/*
+ * flip_plane - Flips one dim x dim plane in PLANE_TILE square tiles so
+ *     the column-strided side of a rotate stays within a few pages
+ */
+static void flip_plane(int dim, const unsigned short *src, unsigned short *dst)
+{
+    long o, di, dj;
+    int ti, tj, i, j;
+
+    flip_affine(dim, &o, &di, &dj);
+    for (ti = 0; ti < dim; ti += PLANE_TILE) {
+        int iend = ti + PLANE_TILE < dim ? ti + PLANE_TILE : dim;
+        for (tj = 0; tj < dim; tj += PLANE_TILE) {
+            int jend = tj + PLANE_TILE < dim ? tj + PLANE_TILE : dim;
+            for (i = ti; i < iend; i++) {
+                const unsigned short *s = &src[RIDX(i, 0, dim)];
+                unsigned short *d = dst + o + i * di;
+                for (j = tj; j < jend; j++)
+                    d[j * dj] = s[j];
+            }
+        }
+    }
+}
+
+/*
+ * planar_flip - Applies the current flip to each plane of src
+ */
+void planar_flip(const planar_image *src, planar_image *dst)
+{
+    flip_plane(src->dim, src->red, dst->red);
+    flip_plane(src->dim, src->green, dst->green);
+    flip_plane(src->dim, src->blue, dst->blue);
+}
+
+/*
+ * planar_flip_pixels - planar_flip() with conversions at both ends, so
+ *     the driver can check and time it
+ */
+char planar_flip_descr[] = "planar_flip: Per-plane tiled flip plus AoS<->SoA conversion";
+void planar_flip_pixels(int dim, pixel *src, pixel *dst)
+{
+    if (!planar_scratch(dim)) {
+        naive_flip(dim, src, dst);
+        return;
+    }
+    pixels_to_planar(dim, src, &planar_in);
+    planar_flip(&planar_in, &planar_out);
+    planar_to_pixels(dim, &planar_out, dst);
+}
+
+/*********************************************************************
+ * register_flip_functions - Register all of your different versions
+ *     of the flip kernel with the driver by calling the
+ *     add_flip_function() for each test function. When you run the
+ *     driver program, it will test and report the performance of each
+ *     registered test function.  
+ *********************************************************************/
+
+void register_flip_functions() 
+{
+    add_flip_function(&flip, flip_descr);   
+    add_flip_function(&planar_flip_pixels, planar_flip_descr);
+    add_flip_function(&recursive_flip, recursive_flip_descr);
+    add_flip_function(&block_flip, block_flip_descr);
+    add_flip_function(&stream_flip, stream_flip_descr);
+    add_flip_function(&spec_flip, spec_flip_descr);
+    add_flip_function(&view_flip, view_flip_descr);
+    add_flip_function(&chain_flip, chain_flip_descr);
+    add_rect_flip_function(&flip_rect, flip_rect_descr);
+    add_inplace_flip_function(&inplace_flip, inplace_flip_descr);
+    //add_flip_function(&naive_flip, naive_flip_descr);   
+    /* ... Register additional test functions here */
+}
+
+
+/***************
+ * CONVOLVE KERNEL
+ **************/
+ 
+/***************************************************************
+ * Various typedefs and helper functions for the convolve function
+ * You may modify these any way you like.
+ **************************************************************/
+
+/* A struct used to compute a pixel value */
+typedef struct {
+    float red;
+    float green;
+    float blue;
+    float weight;
+} pixel_sum;
+
+/******************************************************
+ * Your different versions of the convolve kernel go here
+ ******************************************************/
+
+/*
+ * naive_convolve - The naive baseline version of convolve 
+ */
+char naive_convolve_descr[] = "naive_convolve: Naive baseline implementation";
+void naive_convolve(int dim, pixel *src, pixel *dst) 
+{
+    int i, j, ii, jj, curI, curJ;
+    pixel_sum ps;
+    
+    for (j = 0; j < dim; j++){
+        for (i = 0; i < dim; i++){
+            ps.red    = 0.0;
+            ps.green  = 0.0;
+            ps.blue   = 0.0;
+            ps.weight = 0.0;
+            for (jj = -2; jj <= 2; jj++){
+                for (ii = -2; ii <= 2; ii++){
+                    curJ = j+jj;
+                    if(curJ<0 || curJ>=dim){
+                        continue;	
+                    }
+                    curI = i+ii;
+                    if(curI<0 || curI>=dim){
+                        continue;
+                    }
+                    ps.red   += src[RIDX(curI, curJ, dim)].red *   kernel[ii+2][jj+2];
+                    ps.green += src[RIDX(curI, curJ, dim)].green * kernel[ii+2][jj+2];
+                    ps.blue  += src[RIDX(curI, curJ, dim)].blue *  kernel[ii+2][jj+2];
+                    ps.weight += kernel[ii+2][jj+2];
+                }
+            }
+            dst[RIDX(i,j,dim)].red   = (unsigned short)(ps.red/ps.weight);
+            dst[RIDX(i,j,dim)].green = (unsigned short)(ps.green/ps.weight);
+            dst[RIDX(i,j,dim)].blue  = (unsigned short)(ps.blue/ps.weight);
+        }
+    }
+}
+
+/*
+ * convolve - Your current working version of convolve. 
+ * IMPORTANT: This is the version you will be graded on
+ */
+char convolve_descr[] = "convolve: Current working version";
+void convolve(int dim, pixel *src, pixel *dst) 
+{
+    int i, j, ii, jj, curI, curJ;
+    pixel_sum ps;
+    
+    for (i = 0; i < dim; i++)
+    {
+        for (j = 0; j < dim; j++)
+        {
+        //possible "blocking" could be used here for larger outer loops increments to iterate over?
+            ps.red    = 0.0;
+            ps.green  = 0.0;
+            ps.blue   = 0.0;
+            ps.weight = 0.0;
+            for (jj = -2; jj <= 2; jj++)
+            {
+            	curJ = j+jj;
+            	if(curJ<0 || curJ>=dim)
+            	{
+                        continue;	
+                }
+                for (ii = -2; ii <= 2; ii++)
+                {
+                    
+                    curI = i+ii;
+                    if(curI<0 || curI>=dim)
+                    {
+                        continue;
+                    }
+                    ps.red   += src[RIDX(curI, curJ, dim)].red *   kernel[ii+2][jj+2];
+                    ps.green += src[RIDX(curI, curJ, dim)].green * kernel[ii+2][jj+2];
+                    ps.blue  += src[RIDX(curI, curJ, dim)].blue *  kernel[ii+2][jj+2];
+                    ps.weight += kernel[ii+2][jj+2];
+                }
+            }
+            dst[RIDX(i,j,dim)].red   = (unsigned short)(ps.red/ps.weight);
+            dst[RIDX(i,j,dim)].green = (unsigned short)(ps.green/ps.weight);
+            dst[RIDX(i,j,dim)].blue  = (unsigned short)(ps.blue/ps.weight);
+        }
+    }
+}
+
+/***************************************************************
+ * Kernel plan - facts about the active kernel that the faster
+ * convolve variants key off. The driver registers our functions
+ * before it loads kernel[][], so the plan is built lazily on the
+ * first call and rebuilt only if kernel[][] changes afterwards.
+ **************************************************************/
+
+/* Largest value a float holds exactly: 2^24 */
+#define FLOAT_EXACT_LIMIT 16777216.0f
+#define CHANNEL_MAX 65535.0f
+
+/* A weight turned into a multiply-shift: |s|/|d| == (|s|*m) >> shift */
+typedef struct {
+    int d;              /* the weight; 0 means the pixel comes out 0 */
+    unsigned int m;     /* ceil(2^shift / |d|) */
+    int shift;          /* 24 + ceil(log2 |d|) */
+} int_divisor;
+
+/*
+ * make_int_divisor - Exact for every |s| < 2^24: the rounding error
+ *     of m is below 2^-24 per unit of s, which never reaches 1/|d|
+ */
+static void make_int_divisor(int d, int_divisor *div)
+{
+    unsigned int a = d < 0 ? -d : d;
+    int l = 0;
+
+    div->d = d;
+    div->m = 0;
+    div->shift = 0;
+    if (!a)
+        return;
+    while ((1u << l) < a)
+        l++;
+    div->shift = 24 + l;
+    div->m = (unsigned int)((((unsigned long long)1 << div->shift) + a - 1) / a);
+}
+
+/*
+ * int_scale - Truncated s/d, matching (int)((float)s/(float)d)
+ */
+static inline int int_scale(int s, const int_divisor *div)
+{
+    unsigned int a = s < 0 ? -s : s;
+    int q;
+
+    if (!div->d)
+        return 0;
+    q = (int)(((unsigned long long)a * div->m) >> div->shift);
+    return ((s < 0) != (div->d < 0)) ? -q : q;
+}
+
+/*
+ * Normalization for one border class. A pixel's weight only depends
+ * on how far it is from each edge: 0, 1, or 2+ pixels from the top,
+ * and the same for the bottom, left and right. edge_class() maps a
+ * coordinate to 0..4 (0, 1, interior, dim-2, dim-1) and the plan
+ * keeps one entry per (row class, column class).
+ */
+typedef struct {
+    float weight;       /* in-bounds tap sum, in check_convolution() order */
+    double recip;       /* 1/weight (0 if the weight is 0), for exact kernels */
+    int_divisor div;    /* weight as a multiply-shift, for exact kernels */
+} border_norm;
+
+typedef struct {
+    int valid;
+    float taps[5][5];   /* snapshot of kernel[][] the plan was built from */
+    int exact;          /* integer taps and every partial sum fits in a float */
+    int separable;      /* exact, and taps[i][j] == col[i]*row[j] */
+    float col[5];       /* vertical factor of a rank-1 kernel */
+    float row[5];       /* horizontal factor of a rank-1 kernel */
+    int itaps[5][5];    /* taps as integers, filled in when exact */
+    int builtin;        /* index into builtin_kernels[], -1 if none, -2 unknown */
+    border_norm norm[5][5]; /* indexed by edge_class() of row, column */
+} kernel_plan;
+
+static kernel_plan plan;
+
+/*
+ * is_integer_tap - Returns 1 if t is a whole number small enough
+ *     that products with any channel value stay exact
+ */
+static int is_integer_tap(float t)
+{
+    return t > -32768.0f && t < 32768.0f && t == (float)(int)t;
+}
+
+/*
+ * find_separable_factors - Returns 1 and fills col/row if the kernel
+ *     is an exact outer product of two integer 5-tap vectors. The
+ *     horizontal pass sums must also stay exact for the two-pass
+ *     result to match the 25-tap loop bit for bit.
+ */
+static int find_separable_factors(const float k[5][5], float *col, float *row)
+{
+    int i, j, p = -1, q = -1;
+    float row_abs = 0.0f, col_abs = 0.0f;
+
+    for (i = 0; i < 5 && p < 0; i++)
+        for (j = 0; j < 5; j++)
+            if (k[i][j] != 0.0f) {
+                p = i;
+                q = j;
+                break;
+            }
+    if (p < 0)
+        return 0;
+
+    for (j = 0; j < 5; j++) {
+        row[j] = k[p][j];
+        row_abs += row[j] < 0 ? -row[j] : row[j];
+    }
+    for (i = 0; i < 5; i++) {
+        col[i] = k[i][q] / k[p][q];
+        if (!is_integer_tap(col[i]))
+            return 0;
+        col_abs += col[i] < 0 ? -col[i] : col[i];
+    }
+    for (i = 0; i < 5; i++)
+        for (j = 0; j < 5; j++)
+            if (col[i] * row[j] != k[i][j])
+                return 0;
+
+    return row_abs * CHANNEL_MAX < FLOAT_EXACT_LIMIT &&
+           row_abs * col_abs * CHANNEL_MAX < FLOAT_EXACT_LIMIT;
+}
+
+/*
+ * build_border_norms - Fills the 5x5 border class table. Class c
+ *     keeps kernel rows (or columns) lo[c]..hi[c] of the window.
+ */
+static void build_border_norms(kernel_plan *kp)
+{
+    static const int lo[5] = {2, 1, 0, 0, 0};
+    static const int hi[5] = {4, 4, 4, 3, 2};
+    int rc, cc, ii, jj;
+
+    for (rc = 0; rc < 5; rc++) {
+        for (cc = 0; cc < 5; cc++) {
+            border_norm *n = &kp->norm[rc][cc];
+            n->weight = 0.0f;
+            for (ii = lo[rc]; ii <= hi[rc]; ii++)
+                for (jj = lo[cc]; jj <= hi[cc]; jj++)
+                    n->weight += kp->taps[ii][jj];
+            n->recip = n->weight != 0.0f ? 1.0 / n->weight : 0.0;
+            make_int_divisor(kp->exact ? (int)n->weight : 0, &n->div);
+        }
+    }
+}
+
+/*
+ * build_plan - Fills in *kp for the given taps
+ */
+static void build_plan(kernel_plan *kp, const float taps[5][5])
+{
+    int i, j;
+    float abs_sum = 0.0f;
+
+    memcpy(kp->taps, taps, sizeof(kp->taps));
+    kp->exact = 1;
+    for (i = 0; i < 5; i++) {
+        for (j = 0; j < 5; j++) {
+            if (!is_integer_tap(taps[i][j]))
+                kp->exact = 0;
+            else
+                kp->itaps[i][j] = (int)taps[i][j];
+            abs_sum += taps[i][j] < 0 ? -taps[i][j] : taps[i][j];
+        }
+    }
+    if (abs_sum * CHANNEL_MAX >= FLOAT_EXACT_LIMIT)
+        kp->exact = 0;
+
+    kp->separable = kp->exact &&
+        find_separable_factors(kp->taps, kp->col, kp->row);
+    kp->builtin = -2;
+    build_border_norms(kp);
+    kp->valid = 1;
+}
+
+/*
+ * get_kernel_plan - Returns the plan for the current kernel[][],
+ *     rebuilding it if the kernel has changed since the last call
+ */
+static kernel_plan *get_kernel_plan(void)
+{
+    if (!plan.valid || memcmp(plan.taps, kernel, sizeof(plan.taps)) != 0)
+        build_plan(&plan, (const float (*)[5])kernel);
+    return &plan;
+}
+
+/*
+ * edge_class - Border class of coordinate x (see border_norm)
+ */
+static inline int edge_class(int x, int dim)
+{
+    if (x < 2)
+        return x;
+    if (x >= dim - 2)
+        return 4 - (dim - 1 - x);
+    return 2;
+}
+
+/*
+ * lookup_norm - Returns the normalization entry for pixel (i,j) of a
+ *     width x height image (lookup_norm() is the square case).
+ *     Images narrower or shorter than 5 pixels clip the window on both sides at
+ *     once, which the table doesn't cover, so those get an entry
+ *     built on the spot in *scratch.
+ */
+static const border_norm *lookup_norm_rect(const kernel_plan *kp, int width, int height,
+                                           int i, int j, border_norm *scratch)
+{
+    int ii, jj;
+
+    if (width >= 5 && height >= 5)
+        return &kp->norm[edge_class(i, height)][edge_class(j, width)];
+
+    scratch->weight = 0.0f;
+    for (ii = i - 2; ii <= i + 2; ii++)
+        for (jj = j - 2; jj <= j + 2; jj++)
+            if (ii >= 0 && ii < height && jj >= 0 && jj < width)
+                scratch->weight += kp->taps[ii-i+2][jj-j+2];
+    scratch->recip = scratch->weight != 0.0f ? 1.0 / scratch->weight : 0.0;
+    make_int_divisor(kp->exact ? (int)scratch->weight : 0, &scratch->div);
+    return scratch;
+}
+
+static const border_norm *lookup_norm(const kernel_plan *kp, int dim, int i, int j,
+                                      border_norm *scratch)
+{
+    return lookup_norm_rect(kp, dim, dim, i, j, scratch);
+}
+
+/* Keeps exact integer quotients from truncating to one below */
+#define RECIP_NUDGE (1.0 / (1 << 26))
+
+/*
+ * normalize - sum/weight truncated to a channel value. For exact
+ *     kernels the sum is an integer below 2^24 and |weight| <= 256, so
+ *     a quotient is either an integer or at least 1/256 from one;
+ *     the double reciprocal is off by under 2^-28, and nudging it
+ *     away from zero gives the same truncation as the float divide.
+ *     Other kernels divide exactly like check_convolution().
+ */
+static inline unsigned short normalize(float sum, const border_norm *n, int exact)
+{
+    double q;
+
+    if (!exact)
+        return (unsigned short)(sum / n->weight);
+    q = sum * n->recip;
+    return (unsigned short)(int)(q >= 0.0 ? q + RECIP_NUDGE : q - RECIP_NUDGE);
+}
+
+/*
+ * separable_filter_row - Horizontal pass: runs the 5-tap row factor
+ *     across one source row, writing 3 floats (r,g,b) per pixel
+ */
+static void separable_filter_row(int dim, const pixel *src, const float *f, float *out)
+{
+    int j, jj, cur;
+
+    for (j = 0; j < dim; j++) {
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+        if (j >= 2 && j < dim - 2) {
+            const pixel *s = &src[j-2];
+            r = s[0].red * f[0] + s[1].red * f[1] + s[2].red * f[2] +
+                s[3].red * f[3] + s[4].red * f[4];
+            g = s[0].green * f[0] + s[1].green * f[1] + s[2].green * f[2] +
+                s[3].green * f[3] + s[4].green * f[4];
+            b = s[0].blue * f[0] + s[1].blue * f[1] + s[2].blue * f[2] +
+                s[3].blue * f[3] + s[4].blue * f[4];
+        }
+        else {
+            for (jj = -2; jj <= 2; jj++) {
+                cur = j + jj;
+                if (cur < 0 || cur >= dim)
+                    continue;
+                r += src[cur].red   * f[jj+2];
+                g += src[cur].green * f[jj+2];
+                b += src[cur].blue  * f[jj+2];
+            }
+        }
+        out[3*j]   = r;
+        out[3*j+1] = g;
+        out[3*j+2] = b;
+    }
+}
+
+/* Ring of 5 horizontally filtered rows, indexed by source row % 5 */
+static float *separable_rows = NULL;
+static int separable_rows_dim = 0;
+
+/*
+ * separable_convolve - Two-pass engine for rank-1 kernels such as the
+ *     gaussian blur: a horizontal 5-tap pass into a ring of filtered
+ *     rows, then a vertical 5-tap pass per output pixel (10
+ *     multiply-adds instead of 25). All sums are exact integers in
+ *     float, so the result matches the 25-tap loop bit for bit.
+ *     Kernels that don't factor go through convolve().
+ */
+char separable_convolve_descr[] = "separable_convolve: Two-pass engine for rank-1 kernels";
+void separable_convolve(int dim, pixel *src, pixel *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+    const float *c = kp->col;
+    const border_norm *n;
+    border_norm scratch;
+    int i, j, ii, next;
+
+    if (!kp->separable) {
+        convolve(dim, src, dst);
+        return;
+    }
+    if (dim > separable_rows_dim) {
+        free(separable_rows);
+        separable_rows = malloc(5 * 3 * (size_t)dim * sizeof(float));
+        separable_rows_dim = separable_rows ? dim : 0;
+        if (!separable_rows) {
+            convolve(dim, src, dst);
+            return;
+        }
+    }
+
+    for (next = 0; next < 2 && next < dim; next++)
+        separable_filter_row(dim, &src[RIDX(next, 0, dim)], kp->row,
+                             &separable_rows[(next % 5) * 3 * dim]);
+
+    for (i = 0; i < dim; i++) {
+        const float *h[5];
+
+        if (next < dim) {
+            separable_filter_row(dim, &src[RIDX(next, 0, dim)], kp->row,
+                                 &separable_rows[(next % 5) * 3 * dim]);
+            next++;
+        }
+        for (ii = -2; ii <= 2; ii++)
+            h[ii+2] = (i + ii >= 0 && i + ii < dim) ?
+                &separable_rows[((i + ii) % 5) * 3 * dim] : NULL;
+
+        for (j = 0; j < dim; j++) {
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            for (ii = 0; ii < 5; ii++) {
+                if (!h[ii])
+                    continue;
+                r += h[ii][3*j]   * c[ii];
+                g += h[ii][3*j+1] * c[ii];
+                b += h[ii][3*j+2] * c[ii];
+            }
+            n = lookup_norm(kp, dim, i, j, &scratch);
+            dst[RIDX(i,j,dim)].red   = normalize(r, n, 1);
+            dst[RIDX(i,j,dim)].green = normalize(g, n, 1);
+            dst[RIDX(i,j,dim)].blue  = normalize(b, n, 1);
+        }
+    }
+}
+
+/***************************************************************
+ * Vectorized convolve. A row of pixels is 3*dim consecutive
+ * unsigned shorts and every channel uses the same tap, so the
+ * interior can be computed directly on that flat array: output
+ * element x of row i sums taps over the 5x5 window of elements
+ * x + 3*jj in rows i+ii. Taps are applied in the same order as
+ * check_convolution() with separate multiplies and adds, so the
+ * result is bit-exact for any kernel, not just integer ones.
+ **************************************************************/
+
+/*
+ * convolve_pixel_checked - Convolves one pixel with full bounds
+ *     checks, in check_convolution()'s summation order
+ */
+static void convolve_pixel_checked(int dim, const pixel *src, pixel *dst, int i, int j,
+                                   const kernel_plan *kp)
+{
+    int ii, jj;
+    float r = 0.0f, g = 0.0f, b = 0.0f;
+    border_norm scratch;
+    const border_norm *n = lookup_norm(kp, dim, i, j, &scratch);
+
+    for (ii = i - 2; ii <= i + 2; ii++) {
+        if (ii < 0 || ii >= dim)
+            continue;
+        for (jj = j - 2; jj <= j + 2; jj++) {
+            if (jj < 0 || jj >= dim)
+                continue;
+            r += src[RIDX(ii,jj,dim)].red   * kernel[ii-i+2][jj-j+2];
+            g += src[RIDX(ii,jj,dim)].green * kernel[ii-i+2][jj-j+2];
+            b += src[RIDX(ii,jj,dim)].blue  * kernel[ii-i+2][jj-j+2];
+        }
+    }
+    dst[RIDX(i,j,dim)].red   = normalize(r, n, kp->exact);
+    dst[RIDX(i,j,dim)].green = normalize(g, n, kp->exact);
+    dst[RIDX(i,j,dim)].blue  = normalize(b, n, kp->exact);
+}
+
+/*
+ * convolve_border_frame - Runs the checked path over the part of the
+ *     2-pixel frame around the interior that lies in rows [i0, i1)
+ *     (every pixel of those rows if dim < 5)
+ */
+static void convolve_border_frame(int dim, const pixel *src, pixel *dst,
+                                  const kernel_plan *kp, int i0, int i1)
+{
+    int i, j;
+
+    for (i = i0; i < i1; i++) {
+        if (i < 2 || i >= dim - 2 || dim < 5) {
+            for (j = 0; j < dim; j++)
+                convolve_pixel_checked(dim, src, dst, i, j, kp);
+        }
+        else {
+            convolve_pixel_checked(dim, src, dst, i, 0, kp);
+            convolve_pixel_checked(dim, src, dst, i, 1, kp);
+            convolve_pixel_checked(dim, src, dst, i, dim - 2, kp);
+            convolve_pixel_checked(dim, src, dst, i, dim - 1, kp);
+        }
+    }
+}
+
+/*
+ * convolve_flat_scalar - Computes flat elements [x, end) of one
+ *     interior row. s points at the first element of row i-2.
+ */
+static void convolve_flat_scalar(const unsigned short *s, int stride,
+                                 unsigned short *out, int x, int end, float weight)
+{
+    int ii, jj;
+
+    for (; x < end; x++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += s[ii*stride + x + 3*(jj-2)] * kernel[ii][jj];
+        out[x] = (unsigned short)(sum/weight);
+    }
+}
+
+/* Loads 8 unsigned shorts and widens them to floats */
+#define LOAD8_PS(p) _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(p))))
+
+/*
+ * convolve_interior_avx2 - 8 lanes per vector, 4 vectors in flight to
+ *     hide the add latency of each accumulator chain. Rows [i0, i1)
+ *     must lie in the interior rows 2..dim-3.
+ */
+__attribute__((target("avx2")))
+static void convolve_interior_avx2(int dim, const pixel *src, pixel *dst, float weight,
+                                   int i0, int i1)
+{
+    int i, ii, jj, x;
+    const int stride = 3 * dim;
+    const int end = stride - 6;
+    const __m256 w = _mm256_set1_ps(weight);
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+
+    for (i = i0; i < i1; i++) {
+        const unsigned short *s = (const unsigned short *)&src[RIDX(i-2, 0, dim)];
+        unsigned short *out = (unsigned short *)&dst[RIDX(i, 0, dim)];
+
+        for (x = 6; x + 32 <= end; x += 32) {
+            __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+            __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+            for (ii = 0; ii < 5; ii++) {
+                const unsigned short *p = s + ii*stride + x - 6;
+                for (jj = 0; jj < 5; jj++, p += 3) {
+                    __m256 k = _mm256_broadcast_ss(&kernel[ii][jj]);
+                    a0 = _mm256_add_ps(a0, _mm256_mul_ps(LOAD8_PS(p),      k));
+                    a1 = _mm256_add_ps(a1, _mm256_mul_ps(LOAD8_PS(p + 8),  k));
+                    a2 = _mm256_add_ps(a2, _mm256_mul_ps(LOAD8_PS(p + 16), k));
+                    a3 = _mm256_add_ps(a3, _mm256_mul_ps(LOAD8_PS(p + 24), k));
+                }
+            }
+            __m256i q01 = _mm256_packus_epi32(
+                _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a0, w)), low16),
+                _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a1, w)), low16));
+            __m256i q23 = _mm256_packus_epi32(
+                _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a2, w)), low16),
+                _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a3, w)), low16));
+            _mm256_storeu_si256((__m256i *)(out + x),
+                                _mm256_permute4x64_epi64(q01, 0xD8));
+            _mm256_storeu_si256((__m256i *)(out + x + 16),
+                                _mm256_permute4x64_epi64(q23, 0xD8));
+        }
+        for (; x + 8 <= end; x += 8) {
+            __m256 a = _mm256_setzero_ps();
+            for (ii = 0; ii < 5; ii++) {
+                const unsigned short *p = s + ii*stride + x - 6;
+                for (jj = 0; jj < 5; jj++, p += 3)
+                    a = _mm256_add_ps(a, _mm256_mul_ps(LOAD8_PS(p),
+                                                       _mm256_broadcast_ss(&kernel[ii][jj])));
+            }
+            __m256i q = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a, w)), low16);
+            q = _mm256_permute4x64_epi64(_mm256_packus_epi32(q, q), 0xD8);
+            _mm_storeu_si128((__m128i *)(out + x), _mm256_castsi256_si128(q));
+        }
+        convolve_flat_scalar(s, stride, out, x, end, weight);
+    }
+}
+
+/*
+ * convolve_interior_sse4 - Same loop with 4 lanes for hosts without AVX2
+ */
+__attribute__((target("sse4.1")))
+static void convolve_interior_sse4(int dim, const pixel *src, pixel *dst, float weight,
+                                   int i0, int i1)
+{
+    int i, ii, jj, x;
+    const int stride = 3 * dim;
+    const int end = stride - 6;
+    const __m128 w = _mm_set1_ps(weight);
+    const __m128i low16 = _mm_set1_epi32(0xFFFF);
+
+    for (i = i0; i < i1; i++) {
+        const unsigned short *s = (const unsigned short *)&src[RIDX(i-2, 0, dim)];
+        unsigned short *out = (unsigned short *)&dst[RIDX(i, 0, dim)];
+
+        for (x = 6; x + 8 <= end; x += 8) {
+            __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+            for (ii = 0; ii < 5; ii++) {
+                const unsigned short *p = s + ii*stride + x - 6;
+                for (jj = 0; jj < 5; jj++, p += 3) {
+                    __m128 k = _mm_set1_ps(kernel[ii][jj]);
+                    __m128i v = _mm_loadu_si128((const __m128i *)p);
+                    a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(v)), k));
+                    a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_cvtepi32_ps(
+                        _mm_cvtepu16_epi32(_mm_srli_si128(v, 8))), k));
+                }
+            }
+            __m128i q = _mm_packus_epi32(
+                _mm_and_si128(_mm_cvttps_epi32(_mm_div_ps(a0, w)), low16),
+                _mm_and_si128(_mm_cvttps_epi32(_mm_div_ps(a1, w)), low16));
+            _mm_storeu_si128((__m128i *)(out + x), q);
+        }
+        convolve_flat_scalar(s, stride, out, x, end, weight);
+    }
+}
+
+/*
+ * convolve_interior_scalar - Flat loop for hosts with neither
+ */
+static void convolve_interior_scalar(int dim, const pixel *src, pixel *dst, float weight,
+                                     int i0, int i1)
+{
+    int i;
+
+    for (i = i0; i < i1; i++)
+        convolve_flat_scalar((const unsigned short *)&src[RIDX(i-2, 0, dim)], 3 * dim,
+                             (unsigned short *)&dst[RIDX(i, 0, dim)], 6, 3 * dim - 6, weight);
+}
+
+/*
+ * simd_convolve_rows - Float engine for output rows [i0, i1)
+ */
+static void simd_convolve_rows(int dim, const pixel *src, pixel *dst,
+                               const kernel_plan *kp, int i0, int i1)
+{
+    int lo = i0 > 2 ? i0 : 2;
+    int hi = i1 < dim - 2 ? i1 : dim - 2;
+
+    if (dim >= 5 && lo < hi) {
+        float weight = kp->norm[2][2].weight;
+        if (__builtin_cpu_supports("avx2"))
+            convolve_interior_avx2(dim, src, dst, weight, lo, hi);
+        else if (__builtin_cpu_supports("sse4.1"))
+            convolve_interior_sse4(dim, src, dst, weight, lo, hi);
+        else
+            convolve_interior_scalar(dim, src, dst, weight, lo, hi);
+    }
+    convolve_border_frame(dim, src, dst, kp, i0, i1);
+}
+
+/*
+ * simd_convolve - Vectorized interior with no bounds checks; only the
+ *     2-pixel border frame goes through the checked scalar path
+ */
+char simd_convolve_descr[] = "simd_convolve: AVX2/SSE4 interior, scalar border";
+void simd_convolve(int dim, pixel *src, pixel *dst)
+{
+    simd_convolve_rows(dim, src, dst, get_kernel_plan(), 0, dim);
+}
+
+/***************************************************************
+ * Integer convolve. For exact kernels every sum is an integer
+ * below 2^24, and for such sums (unsigned short)(sum/weight) in
+ * float is the truncated integer quotient. So the path keeps the
+ * taps as ints, accumulates in int32 and replaces the divide with
+ * the multiply-shift of the plan's border_norm table. With
+ * shift = 24 + ceil(log2 |d|) and m = ceil(2^shift / |d|) that is
+ * exact for every dividend below 2^24, so the path uses it without
+ * asking; verify_int_scale() checks it against the float divide and
+ * the driver runs that check for every built-in kernel (-c).
+ **************************************************************/
+
+/*
+ * verify_int_scale - Proof-by-test of the scale step. For every
+ *     weight a pixel can see (any clipping of the window by the
+ *     image edges) and every channel value v in 0..65535, compares
+ *     int_scale() against the float divide and truncate used by
+ *     check_convolution() at v*|w| and the sums on either side of
+ *     each quotient boundary, in both signs.
+ */
+static int verify_int_scale(const kernel_plan *kp)
+{
+    int r0, r1, c0, c1, ii, jj, v, t, sign;
+
+    for (r0 = 0; r0 <= 2; r0++)
+    for (r1 = 2; r1 <= 4; r1++)
+    for (c0 = 0; c0 <= 2; c0++)
+    for (c1 = 2; c1 <= 4; c1++) {
+        int w = 0, a;
+        float fw;
+        int_divisor div;
+
+        for (ii = r0; ii <= r1; ii++)
+            for (jj = c0; jj <= c1; jj++)
+                w += kp->itaps[ii][jj];
+        make_int_divisor(w, &div);
+        fw = (float)w;
+        a = w < 0 ? -w : w;
+
+        for (v = 0; v < 65536; v++) {
+            int probe[4];
+            probe[0] = v*a - 1;
+            probe[1] = v*a;
+            probe[2] = v*a + 1;
+            probe[3] = v*a + a - 1;
+            for (t = 0; t < 4; t++) {
+                for (sign = -1; sign <= 1; sign += 2) {
+                    int s = sign * probe[t];
+                    if (s <= -(int)FLOAT_EXACT_LIMIT || s >= (int)FLOAT_EXACT_LIMIT)
+                        continue;
+                    if ((unsigned short)int_scale(s, &div) !=
+                        (unsigned short)((float)s / fw))
+                        return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * convolve_pixel_int - Integer version of convolve_pixel_checked()
+ */
+static void convolve_pixel_int(int dim, const pixel *src, pixel *dst, int i, int j,
+                               const kernel_plan *kp)
+{
+    int ii, jj, k;
+    int r = 0, g = 0, b = 0;
+    border_norm scratch;
+    const int_divisor *div = &lookup_norm(kp, dim, i, j, &scratch)->div;
+
+    for (ii = i - 2; ii <= i + 2; ii++) {
+        if (ii < 0 || ii >= dim)
+            continue;
+        for (jj = j - 2; jj <= j + 2; jj++) {
+            if (jj < 0 || jj >= dim)
+                continue;
+            k = kp->itaps[ii-i+2][jj-j+2];
+            r += src[RIDX(ii,jj,dim)].red   * k;
+            g += src[RIDX(ii,jj,dim)].green * k;
+            b += src[RIDX(ii,jj,dim)].blue  * k;
+        }
+    }
+    dst[RIDX(i,j,dim)].red   = (unsigned short)int_scale(r, div);
+    dst[RIDX(i,j,dim)].green = (unsigned short)int_scale(g, div);
+    dst[RIDX(i,j,dim)].blue  = (unsigned short)int_scale(b, div);
+}
+
+/*
+ * int_convolve_flat - Integer flat loop over elements [x, end) of one
+ *     interior row; s points at the first element of row i-2
+ */
+static void int_convolve_flat(const unsigned short *s, int stride, unsigned short *out,
+                              int x, int end, const kernel_plan *kp, const int_divisor *div)
+{
+    int ii, jj;
+
+    for (; x < end; x++) {
+        int sum = 0;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += s[ii*stride + x + 3*(jj-2)] * kp->itaps[ii][jj];
+        out[x] = (unsigned short)int_scale(sum, div);
+    }
+}
+
+/*
+ * int_scale_avx2 - int_scale() on 8 lanes. The 32x32->64 bit
+ *     multiplies only cover even lanes, so odd lanes go through a
+ *     second multiply and are blended back in.
+ */
+__attribute__((target("avx2")))
+static inline __m256i int_scale_avx2(__m256i s, __m256i m, __m128i shift, int neg)
+{
+    __m256i a = _mm256_abs_epi32(s);
+    __m256i even = _mm256_srl_epi64(_mm256_mul_epu32(a, m), shift);
+    __m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), m), shift);
+    __m256i q = _mm256_sign_epi32(_mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA), s);
+
+    return neg ? _mm256_sub_epi32(_mm256_setzero_si256(), q) : q;
+}
+
+/*
+ * int_convolve_interior_avx2 - 16 flat elements per step using
+ *     vpmaddwd, which multiplies 16-bit pairs and adds them into
+ *     32-bit lanes: two taps per instruction. Channel values are
+ *     unsigned, so they are biased into signed range by flipping the
+ *     top bit and 32768*sum(taps) is added back at the start.
+ */
+__attribute__((target("avx2")))
+static void int_convolve_interior_avx2(int dim, const pixel *src, pixel *dst,
+                                       const kernel_plan *kp, const int_divisor *div,
+                                       int i0, int i1)
+{
+    int i, ii, x;
+    const int stride = 3 * dim;
+    const int end = stride - 6;
+    const __m256i flip = _mm256_set1_epi16((short)0x8000);
+    const __m256i m = _mm256_set1_epi32((int)div->m);
+    const __m128i shift = _mm_cvtsi32_si128(div->shift);
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    __m256i pairs[5][3];
+    __m256i bias = _mm256_set1_epi32(32768 * div->d);
+
+    for (ii = 0; ii < 5; ii++) {
+        const int *k = kp->itaps[ii];
+        pairs[ii][0] = _mm256_set1_epi32((k[0] & 0xFFFF) | (k[1] << 16));
+        pairs[ii][1] = _mm256_set1_epi32((k[2] & 0xFFFF) | (k[3] << 16));
+        pairs[ii][2] = _mm256_set1_epi32(k[4] & 0xFFFF);
+    }
+
+    for (i = i0; i < i1; i++) {
+        const unsigned short *s = (const unsigned short *)&src[RIDX(i-2, 0, dim)];
+        unsigned short *out = (unsigned short *)&dst[RIDX(i, 0, dim)];
+
+        for (x = 6; x + 16 <= end; x += 16) {
+            __m256i lo = bias, hi = bias;
+            for (ii = 0; ii < 5; ii++) {
+                const unsigned short *p = s + ii*stride + x - 6;
+                __m256i v0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)p), flip);
+                __m256i v1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 3)), flip);
+                __m256i v2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 6)), flip);
+                __m256i v3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 9)), flip);
+                __m256i v4 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 12)), flip);
+                __m256i zero = _mm256_setzero_si256();
+                lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(v0, v1), pairs[ii][0]));
+                hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(v0, v1), pairs[ii][0]));
+                lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(v2, v3), pairs[ii][1]));
+                hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(v2, v3), pairs[ii][1]));
+                lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(v4, zero), pairs[ii][2]));
+                hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(v4, zero), pairs[ii][2]));
+            }
+            /* unpacklo/hi work per 128-bit lane, so packing lo with hi
+               puts the 16 results straight back in order */
+            lo = _mm256_and_si256(int_scale_avx2(lo, m, shift, div->d < 0), low16);
+            hi = _mm256_and_si256(int_scale_avx2(hi, m, shift, div->d < 0), low16);
+            _mm256_storeu_si256((__m256i *)(out + x), _mm256_packus_epi32(lo, hi));
+        }
+        int_convolve_flat(s, stride, out, x, end, kp, div);
+    }
+}
+
+/*
+ * int_convolve_usable - Returns 1 if the integer path reproduces
+ *     check_convolution() for the plan's kernel
+ */
+static int int_convolve_usable(const kernel_plan *kp)
+{
+    return kp->exact;
+}
+
+/*
+ * int_convolve_verify - Runs verify_int_scale() on the active kernel.
+ *     Returns 1 if it passes or the integer path doesn't take the
+ *     kernel at all.
+ */
+int int_convolve_verify(void)
+{
+    const kernel_plan *kp = get_kernel_plan();
+
+    return !kp->exact || verify_int_scale(kp);
+}
+
+/* Computes interior rows [i0, i1) of the integer engine */
+typedef void (*int_interior_func)(int, const pixel *, pixel *, const kernel_plan *,
+                                  const int_divisor *, int, int);
+
+/*
+ * int_convolve_rows - Integer engine for output rows [i0, i1); the
+ *     caller has checked int_convolve_usable(). The interior goes
+ *     through interior if given, else the generic AVX2 or flat loop.
+ */
+static void int_convolve_rows(int dim, const pixel *src, pixel *dst, const kernel_plan *kp,
+                              int_interior_func interior, int i0, int i1)
+{
+    const int_divisor *div = &kp->norm[2][2].div;
+    int lo = i0 > 2 ? i0 : 2;
+    int hi = i1 < dim - 2 ? i1 : dim - 2;
+    int i, j;
+
+    if (dim < 5 || !div->d)
+        lo = hi = i1;       /* no vector interior: every row takes the checked path */
+    if (lo < hi) {
+        if (interior) {
+            interior(dim, src, dst, kp, div, lo, hi);
+        }
+        else if (__builtin_cpu_supports("avx2")) {
+            int_convolve_interior_avx2(dim, src, dst, kp, div, lo, hi);
+        }
+        else {
+            for (i = lo; i < hi; i++)
+                int_convolve_flat((const unsigned short *)&src[RIDX(i-2, 0, dim)], 3 * dim,
+                                  (unsigned short *)&dst[RIDX(i, 0, dim)], 6, 3 * dim - 6,
+                                  kp, div);
+        }
+    }
+    for (i = i0; i < i1; i++) {
+        if (i < lo || i >= hi) {
+            for (j = 0; j < dim; j++)
+                convolve_pixel_int(dim, src, dst, i, j, kp);
+        }
+        else {
+            convolve_pixel_int(dim, src, dst, i, 0, kp);
+            convolve_pixel_int(dim, src, dst, i, 1, kp);
+            convolve_pixel_int(dim, src, dst, i, dim - 2, kp);
+            convolve_pixel_int(dim, src, dst, i, dim - 1, kp);
+        }
+    }
+}
+
+/*
+ * int_convolve - Integer accumulation path for integer-valued kernels.
+ *     Kernels that aren't exact go through simd_convolve().
+ */
+char int_convolve_descr[] = "int_convolve: Integer accumulation, exact scale step";
+void int_convolve(int dim, pixel *src, pixel *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+
+    if (int_convolve_usable(kp))
+        int_convolve_rows(dim, src, dst, kp, NULL, 0, dim);
+    else
+        simd_convolve_rows(dim, src, dst, kp, 0, dim);
+}
+
+/***************************************************************
+ * Specialized convolve. The nine kernels built into driver.c get
+ * their own interior loop with the taps as compile-time constants.
+ * The loop is the integer engine's vpmaddwd one, which is bound by
+ * the shuffles that pair 16-bit sources, so the specialization goes
+ * where those are spent: zero taps are dropped and the remaining
+ * taps are paired in order across the whole window rather than
+ * within each row: sobel, smoothing and the embosses need 11 pairs
+ * instead of 15, sharpen and the gaussian 13. Regrouping the int32
+ * sums can't change the result; normalization is the integer path's.
+ *
+ * BUILTIN_KERNELS must list the same taps as driver.c.
+ **************************************************************/
+
+#define BUILTIN_KERNELS(X) \
+    X(sharpen, \
+      -1, -1, -1, -1, -1,   -1,   2,  4,   2, -1,   -1,   4,  8,   4, -1, \
+      -1,  2,  4,  2, -1,   -1,  -1, -1,  -1, -1) \
+    X(emboss_tl, \
+      -1, -1, -1, -1,  0,   -1, -16,  4,   0,  1,   -1,  -4,  1,   4,  1, \
+      -1,  0,  4, 16,  1,    0,   1,  1,   1,  1) \
+    X(emboss_tr, \
+       0, -1, -1, -1, -1,    1,   0, -4, -16, -1,    1,   4,  1,  -4, -1, \
+       1, 16,  4,  0, -1,    1,   1,  1,   1,  0) \
+    X(emboss_br, \
+       1,  1,  1,  1,  0,    1,  16,  4,   0, -1,    1,   4,  1,  -4, -1, \
+       1,  0, -4,-16, -1,    0,  -1, -1,  -1, -1) \
+    X(emboss_bl, \
+       0,  1,  1,  1,  1,   -1,   0,  4,  16,  1,   -1,  -4,  1,   4,  1, \
+      -1,-16, -4,  0,  1,   -1,  -1, -1,  -1,  0) \
+    X(guassian_blur, \
+       1,  4,  6,  4,  1,    4,  16, 24,  16,  4,    6,  24, 36,  24,  6, \
+       4, 16, 24, 16,  4,    1,   4,  6,   4,  1) \
+    X(sobel_vertical, \
+       2,  1,  0, -1, -2,    3,   2,  0,  -2, -3,    4,   3,  1,  -3, -4, \
+       3,  2,  0, -2, -3,    2,   1,  0,  -1, -2) \
+    X(sobel_horizontal, \
+       2,  3,  4,  3,  2,    1,   2,  3,   2,  1,    0,   0,  1,   0,  0, \
+      -1, -2, -3, -2, -1,   -2,  -3, -4,  -3, -2) \
+    X(smoothing, \
+       0,  1,  2,  1,  0,    1,   4,  8,   4,  1,    2,   8, 16,   8,  2, \
+       1,  4,  8,  4,  1,    0,   1,  2,   1,  0)
+
+/*
+ * SPEC_TAP - Feeds tap k at window position (ii, jj) to the pairing.
+ *     An odd tap waits in pend/pend_k; the next one is interleaved
+ *     with it and both go through one vpmaddwd per half. Every test
+ *     here is on constants, so the unrolled code folds to a straight
+ *     run of loads, unpacks and multiply-adds.
+ */
+#define SPEC_TAP(k, ii, jj) \
+    if ((k) != 0) { \
+        __m256i v_ = _mm256_xor_si256(_mm256_loadu_si256( \
+            (const __m256i *)(s + (ii)*stride + x + 3*(jj) - 6)), flip); \
+        if (pending) { \
+            __m256i kk_ = _mm256_set1_epi32((pend_k & 0xFFFF) | ((k) << 16)); \
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(pend, v_), kk_)); \
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(pend, v_), kk_)); \
+            pending = 0; \
+        } \
+        else { \
+            pend = v_; \
+            pend_k = (k); \
+            pending = 1; \
+        } \
+    }
+
+#define DEFINE_SPECIALIZED_CONVOLVE(name, k00, k01, k02, k03, k04, k10, k11, k12, k13, k14, \
+                                    k20, k21, k22, k23, k24, k30, k31, k32, k33, k34, \
+                                    k40, k41, k42, k43, k44) \
+__attribute__((target("avx2"))) \
+static void spec_##name##_interior(int dim, const pixel *src, pixel *dst, \
+                                   const kernel_plan *kp, const int_divisor *div, \
+                                   int i0, int i1) \
+{ \
+    int i, x; \
+    const int stride = 3 * dim; \
+    const int end = stride - 6; \
+    const __m256i flip = _mm256_set1_epi16((short)0x8000); \
+    const __m256i m = _mm256_set1_epi32((int)div->m); \
+    const __m128i shift = _mm_cvtsi32_si128(div->shift); \
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF); \
+    const __m256i bias = _mm256_set1_epi32(32768 * div->d); \
+    \
+    for (i = i0; i < i1; i++) { \
+        const unsigned short *s = (const unsigned short *)&src[RIDX(i-2, 0, dim)]; \
+        unsigned short *out = (unsigned short *)&dst[RIDX(i, 0, dim)]; \
+        \
+        for (x = 6; x + 16 <= end; x += 16) { \
+            __m256i lo = bias, hi = bias, pend = _mm256_setzero_si256(); \
+            int pending = 0, pend_k = 0; \
+            SPEC_TAP(k00, 0, 0) SPEC_TAP(k01, 0, 1) SPEC_TAP(k02, 0, 2) \
+            SPEC_TAP(k03, 0, 3) SPEC_TAP(k04, 0, 4) \
+            SPEC_TAP(k10, 1, 0) SPEC_TAP(k11, 1, 1) SPEC_TAP(k12, 1, 2) \
+            SPEC_TAP(k13, 1, 3) SPEC_TAP(k14, 1, 4) \
+            SPEC_TAP(k20, 2, 0) SPEC_TAP(k21, 2, 1) SPEC_TAP(k22, 2, 2) \
+            SPEC_TAP(k23, 2, 3) SPEC_TAP(k24, 2, 4) \
+            SPEC_TAP(k30, 3, 0) SPEC_TAP(k31, 3, 1) SPEC_TAP(k32, 3, 2) \
+            SPEC_TAP(k33, 3, 3) SPEC_TAP(k34, 3, 4) \
+            SPEC_TAP(k40, 4, 0) SPEC_TAP(k41, 4, 1) SPEC_TAP(k42, 4, 2) \
+            SPEC_TAP(k43, 4, 3) SPEC_TAP(k44, 4, 4) \
+            if (pending) { \
+                __m256i kk_ = _mm256_set1_epi32(pend_k & 0xFFFF); \
+                __m256i z_ = _mm256_setzero_si256(); \
+                lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(pend, z_), kk_)); \
+                hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(pend, z_), kk_)); \
+            } \
+            lo = _mm256_and_si256(int_scale_avx2(lo, m, shift, div->d < 0), low16); \
+            hi = _mm256_and_si256(int_scale_avx2(hi, m, shift, div->d < 0), low16); \
+            _mm256_storeu_si256((__m256i *)(out + x), _mm256_packus_epi32(lo, hi)); \
+        } \
+        int_convolve_flat(s, stride, out, x, end, kp, div); \
+    } \
+}
+
+BUILTIN_KERNELS(DEFINE_SPECIALIZED_CONVOLVE)
+
+#define BUILTIN_ENTRY(name, k00, k01, k02, k03, k04, k10, k11, k12, k13, k14, \
+                      k20, k21, k22, k23, k24, k30, k31, k32, k33, k34, \
+                      k40, k41, k42, k43, k44) \
+    {{{k00, k01, k02, k03, k04}, {k10, k11, k12, k13, k14}, {k20, k21, k22, k23, k24}, \
+      {k30, k31, k32, k33, k34}, {k40, k41, k42, k43, k44}}, spec_##name##_interior},
+
+static const struct {
+    float taps[5][5];
+    int_interior_func interior;
+} builtin_kernels[] = {
+    BUILTIN_KERNELS(BUILTIN_ENTRY)
+};
+
+#define NUM_BUILTIN_KERNELS ((int)(sizeof(builtin_kernels) / sizeof(builtin_kernels[0])))
+
+/*
+ * find_builtin_kernel - Index of the built-in kernel equal to the
+ *     plan's taps, or -1; looked up once and kept in the plan
+ */
+static int find_builtin_kernel(kernel_plan *kp)
+{
+    int b;
+
+    if (kp->builtin == -2) {
+        kp->builtin = -1;
+        for (b = 0; b < NUM_BUILTIN_KERNELS; b++)
+            if (memcmp(builtin_kernels[b].taps, kp->taps, sizeof(kp->taps)) == 0)
+                kp->builtin = b;
+    }
+    return kp->builtin;
+}
+
+/*
+ * spec_convolve_kernel - Which built-in kernel spec_convolve() takes
+ *     the active kernel for (driver.c's numbering), or -1 if none
+ */
+int spec_convolve_kernel(void)
+{
+    return find_builtin_kernel(get_kernel_plan());
+}
+
+/*
+ * spec_convolve - Runs the specialized interior for the active kernel
+ *     if it is one of driver.c's; anything else goes to int_convolve()
+ */
+char spec_convolve_descr[] = "spec_convolve: Constant-tap interior per built-in kernel";
+void spec_convolve(int dim, pixel *src, pixel *dst)
+{
+    kernel_plan *kp = get_kernel_plan();
+    int b = find_builtin_kernel(kp);
+
+    if (b < 0 || !int_convolve_usable(kp) || !__builtin_cpu_supports("avx2")) {
+        int_convolve(dim, src, dst);
+        return;
+    }
+    int_convolve_rows(dim, src, dst, kp, builtin_kernels[b].interior, 0, dim);
+}
+
+/***************************************************************
+ * JIT convolve. jit_compile_convolve() turns any 5x5 kernel into
+ * straight-line AVX2 machine code for the interior, written into
+ * an mmap'd buffer that is flipped to executable once complete.
+ * Taps are baked in as constants, zero taps are skipped, and for
+ * exact kernels equal taps are merged so their sources are added
+ * first and multiplied once. Other kernels keep one multiply per
+ * tap in check_convolution() order, which keeps them bit-exact.
+ *
+ * Where executable memory is refused (W^X policies), or with
+ * PERFLAB_JIT=0, the kernel runs on the generic loop instead.
+ **************************************************************/
+
+#define JIT_SLOTS 4
+#define JIT_CODE_SIZE 8192
+
+/* Generated row code: (row i-2 at x-6, out at x, 16-element blocks,
+   row stride in bytes, constants) */
+typedef void (*jit_row_func)(const unsigned short *, unsigned short *, long, long,
+                             const float *);
+
+typedef struct {
+    int used;
+    float taps[5][5];
+    float weight;           /* interior weight, check_convolution() order */
+    jit_row_func row;       /* NULL if the kernel runs on the generic loop */
+    float *consts;          /* 8 copies of each constant, 32-byte aligned */
+    void *code;
+} jit_kernel;
+
+static jit_kernel jit_slots[JIT_SLOTS];
+
+/* x86-64 register numbers */
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9 };
+#define NO_INDEX (-1)
+
+typedef struct {
+    unsigned char *p;
+} jit_buf;
+
+static void emit(jit_buf *b, int byte)
+{
+    *b->p++ = (unsigned char)byte;
+}
+
+static void emit32(jit_buf *b, int v)
+{
+    memcpy(b->p, &v, 4);
+    b->p += 4;
+}
+
+/*
+ * emit_vex - A 256-bit VEX instruction. With base >= 0 the r/m operand
+ *     is [base + index*scale + disp] (always SIB + disp32), otherwise it
+ *     is register rm. vvvv is the extra source register (0 if unused).
+ */
+static void emit_vex(jit_buf *b, int map, int pp, int w, int vvvv, int opcode, int reg,
+                     int rm, int base, int index, int scale, int disp)
+{
+    int x = index >= 0 ? index >> 3 : 0;
+    int bx = base >= 0 ? base >> 3 : rm >> 3;
+
+    emit(b, 0xC4);
+    emit(b, ((~reg >> 3) & 1) << 7 | (~x & 1) << 6 | (~bx & 1) << 5 | map);
+    emit(b, w << 7 | ((~vvvv) & 15) << 3 | 1 << 2 | pp);
+    emit(b, opcode);
+    if (base < 0) {
+        emit(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+        return;
+    }
+    emit(b, 0x80 | (reg & 7) << 3 | 4);
+    emit(b, (scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0) << 6 |
+            (index >= 0 ? index & 7 : 4) << 3 | (base & 7));
+    emit32(b, disp);
+}
+
+#define MAP_0F 1
+#define MAP_0F38 2
+#define MAP_0F3A 3
+#define PP_66 1
+#define PP_F3 2
+
+/* ymm dst = zero-extended 8 words at [base + index*scale + disp] as floats */
+static void emit_load_ps(jit_buf *b, int dst, int base, int index, int scale, int disp)
+{
+    emit_vex(b, MAP_0F38, PP_66, 0, 0, 0x33, dst, 0, base, index, scale, disp);  /* vpmovzxwd */
+    emit_vex(b, MAP_0F, 0, 0, 0, 0x5B, dst, dst, -1, NO_INDEX, 0, 0);           /* vcvtdq2ps */
+}
+
+/* ymm dst = ymm src op [R8 + disp] for op = vaddps 0x58, vmulps 0x59, vdivps 0x5E */
+static void emit_op_const(jit_buf *b, int opcode, int dst, int src, int disp)
+{
+    emit_vex(b, MAP_0F, 0, 0, src, opcode, dst, 0, R8, NO_INDEX, 0, disp);
+}
+
+/* ymm dst = ymm a op ymm c */
+static void emit_op_reg(jit_buf *b, int opcode, int dst, int a, int c)
+{
+    emit_vex(b, MAP_0F, 0, 0, a, opcode, dst, c, -1, NO_INDEX, 0, 0);
+}
+
+/*
+ * tap_address - Row ii of the window: rdi, rdi+rcx, rdi+2rcx,
+ *     r9+2rcx (r9 = rdi+rcx) and rdi+4rcx
+ */
+static void tap_address(int ii, int *base, int *index, int *scale)
+{
+    static const int bases[5] = {RDI, RDI, RDI, R9, RDI};
+    static const int scales[5] = {0, 1, 2, 2, 4};
+
+    *base = bases[ii];
+    *index = ii ? RCX : NO_INDEX;
+    *scale = scales[ii];
+}
+
+/*
+ * jit_emit_row - Emits the row function for jk. Each loop iteration
+ *     makes 16 outputs as two 8-lane blocks accumulated in ymm0/ymm1.
+ *     Constants: one 32-byte entry per tap group, then the weight,
+ *     then the 0xFFFF mask.
+ */
+static void jit_emit_row(jit_kernel *jk, int exact, jit_buf *b)
+{
+    int group_ii[25][25], group_jj[25][25], group_n[25];
+    float group_k[25];
+    int ngroups = 0, g, t, ii, jj, blk, base, index, scale, c;
+    unsigned char *loop;
+
+    for (ii = 0; ii < 5; ii++) {
+        for (jj = 0; jj < 5; jj++) {
+            if (jk->taps[ii][jj] == 0.0f)
+                continue;
+            for (g = 0; exact && g < ngroups; g++)
+                if (group_k[g] == jk->taps[ii][jj])
+                    break;
+            if (!exact || g == ngroups) {
+                g = ngroups++;
+                group_k[g] = jk->taps[ii][jj];
+                group_n[g] = 0;
+            }
+            group_ii[g][group_n[g]] = ii;
+            group_jj[g][group_n[g]++] = jj;
+        }
+    }
+    for (g = 0; g < ngroups; g++)
+        for (c = 0; c < 8; c++)
+            jk->consts[8*g + c] = group_k[g];
+    for (c = 0; c < 8; c++) {
+        jk->consts[8*ngroups + c] = jk->weight;
+        memcpy(&jk->consts[8*(ngroups+1) + c], &(int){0xFFFF}, 4);
+    }
+
+    /* lea r9, [rdi + rcx] */
+    emit(b, 0x4C); emit(b, 0x8D); emit(b, 0x0C); emit(b, 0x0F);
+    loop = b->p;
+    emit_op_reg(b, 0x57, 0, 0, 0);                      /* vxorps ymm0 */
+    emit_op_reg(b, 0x57, 1, 1, 1);                      /* vxorps ymm1 */
+    for (g = 0; g < ngroups; g++) {
+        for (blk = 0; blk < 2; blk++) {
+            for (t = 0; t < group_n[g]; t++) {
+                tap_address(group_ii[g][t], &base, &index, &scale);
+                emit_load_ps(b, t ? 4 + blk : 2 + blk, base, index, scale,
+                             6 * group_jj[g][t] + 16 * blk);
+                if (t)
+                    emit_op_reg(b, 0x58, 2 + blk, 2 + blk, 4 + blk);
+            }
+            emit_op_const(b, 0x59, 2 + blk, 2 + blk, 32 * g);
+            emit_op_reg(b, 0x58, blk, blk, 2 + blk);
+        }
+    }
+    for (blk = 0; blk < 2; blk++) {
+        emit_op_const(b, 0x5E, blk, blk, 32 * ngroups);                        /* vdivps */
+        emit_vex(b, MAP_0F, PP_F3, 0, 0, 0x5B, blk, blk, -1, NO_INDEX, 0, 0);   /* vcvttps2dq */
+        emit_vex(b, MAP_0F, PP_66, 0, blk, 0xDB, blk, 0, R8, NO_INDEX, 0,
+                 32 * (ngroups + 1));                                          /* vpand */
+    }
+    emit_vex(b, MAP_0F38, PP_66, 0, 0, 0x2B, 0, 1, -1, NO_INDEX, 0, 0);        /* vpackusdw */
+    emit_vex(b, MAP_0F3A, PP_66, 1, 0, 0x00, 0, 0, -1, NO_INDEX, 0, 0);        /* vpermq */
+    emit(b, 0xD8);
+    emit_vex(b, MAP_0F, PP_F3, 0, 0, 0x7F, 0, 0, RSI, NO_INDEX, 0, 0);          /* vmovdqu [rsi] */
+
+    emit(b, 0x48); emit(b, 0x83); emit(b, 0xC7); emit(b, 32);   /* add rdi, 32 */
+    emit(b, 0x49); emit(b, 0x83); emit(b, 0xC1); emit(b, 32);   /* add r9, 32 */
+    emit(b, 0x48); emit(b, 0x83); emit(b, 0xC6); emit(b, 32);   /* add rsi, 32 */
+    emit(b, 0x48); emit(b, 0xFF); emit(b, 0xCA);                /* dec rdx */
+    emit(b, 0x0F); emit(b, 0x85);                               /* jnz loop */
+    emit32(b, (int)(loop - (b->p + 4)));
+    emit(b, 0xC5); emit(b, 0xF8); emit(b, 0x77);                /* vzeroupper */
+    emit(b, 0xC3);                                              /* ret */
+}
+
+/*
+ * jit_build - Generates and maps the row code for jk. Leaves jk->row
+ *     NULL when the JIT is off or executable memory is refused.
+ */
+static void jit_build(jit_kernel *jk)
+{
+    char *env = getenv("PERFLAB_JIT");
+    float abs_sum = 0.0f;
+    int exact = 1, ii, jj;
+    jit_buf b;
+
+    jk->row = NULL;
+    jk->code = NULL;
+    if ((env && strcmp(env, "0") == 0) || !__builtin_cpu_supports("avx2"))
+        return;
+
+    for (ii = 0; ii < 5; ii++) {
+        for (jj = 0; jj < 5; jj++) {
+            if (!is_integer_tap(jk->taps[ii][jj]))
+                exact = 0;
+            abs_sum += jk->taps[ii][jj] < 0 ? -jk->taps[ii][jj] : jk->taps[ii][jj];
+        }
+    }
+    if (abs_sum * CHANNEL_MAX >= FLOAT_EXACT_LIMIT)
+        exact = 0;
+
+    jk->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jk->code == MAP_FAILED) {
+        jk->code = NULL;
+        return;
+    }
+    /* constants live in the second half, code in the first */
+    jk->consts = (float *)((char *)jk->code + JIT_CODE_SIZE / 2);
+    b.p = jk->code;
+    jit_emit_row(jk, exact, &b);
+
+    if (mprotect(jk->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jk->code, JIT_CODE_SIZE);
+        jk->code = NULL;
+        return;
+    }
+    jk->row = (jit_row_func)jk->code;
+}
+
+/*
+ * jit_pixel_checked - One border pixel with jk's taps, in
+ *     check_convolution() order
+ */
+static void jit_pixel_checked(const jit_kernel *jk, int dim, const pixel *src, pixel *dst,
+                              int i, int j)
+{
+    int ii, jj;
+    float r = 0.0f, g = 0.0f, b = 0.0f, weight = 0.0f, k;
+
+    for (ii = i - 2; ii <= i + 2; ii++) {
+        if (ii < 0 || ii >= dim)
+            continue;
+        for (jj = j - 2; jj <= j + 2; jj++) {
+            if (jj < 0 || jj >= dim)
+                continue;
+            k = jk->taps[ii-i+2][jj-j+2];
+            r += src[RIDX(ii,jj,dim)].red   * k;
+            g += src[RIDX(ii,jj,dim)].green * k;
+            b += src[RIDX(ii,jj,dim)].blue  * k;
+            weight += k;
+        }
+    }
+    dst[RIDX(i,j,dim)].red   = (unsigned short)(r/weight);
+    dst[RIDX(i,j,dim)].green = (unsigned short)(g/weight);
+    dst[RIDX(i,j,dim)].blue  = (unsigned short)(b/weight);
+}
+
+/*
+ * jit_flat - Generic loop over flat elements [x, end) of an interior
+ *     row with jk's taps; s points at row i-2
+ */
+static void jit_flat(const jit_kernel *jk, const unsigned short *s, int stride,
+                     unsigned short *out, int x, int end)
+{
+    int ii, jj;
+
+    for (; x < end; x++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += s[ii*stride + x + 3*(jj-2)] * jk->taps[ii][jj];
+        out[x] = (unsigned short)(sum/jk->weight);
+    }
+}
+
+/*
+ * jit_run - Convolves with slot n: generated code for whole 16-element
+ *     blocks of the interior, the generic loop for the rest
+ */
+static void jit_run(int n, int dim, pixel *src, pixel *dst)
+{
+    const jit_kernel *jk = &jit_slots[n];
+    int i, j;
+
+    for (i = 0; i < dim; i++) {
+        if (i < 2 || i >= dim - 2 || dim < 5) {
+            for (j = 0; j < dim; j++)
+                jit_pixel_checked(jk, dim, src, dst, i, j);
+            continue;
+        }
+        const unsigned short *s = (const unsigned short *)&src[RIDX(i-2, 0, dim)];
+        unsigned short *out = (unsigned short *)&dst[RIDX(i, 0, dim)];
+        int blocks = jk->row ? (3 * dim - 12) / 16 : 0;
+        if (blocks > 0)
+            jk->row(s, out + 6, blocks, 6L * dim, jk->consts);
+        jit_flat(jk, s, 3 * dim, out, 6 + 16 * blocks, 3 * dim - 6);
+        jit_pixel_checked(jk, dim, src, dst, i, 0);
+        jit_pixel_checked(jk, dim, src, dst, i, 1);
+        jit_pixel_checked(jk, dim, src, dst, i, dim - 2);
+        jit_pixel_checked(jk, dim, src, dst, i, dim - 1);
+    }
+}
+
+/* One lab_test_func per slot, so compiled kernels can be registered */
+static void jit_slot0(int dim, pixel *src, pixel *dst) { jit_run(0, dim, src, dst); }
+static void jit_slot1(int dim, pixel *src, pixel *dst) { jit_run(1, dim, src, dst); }
+static void jit_slot2(int dim, pixel *src, pixel *dst) { jit_run(2, dim, src, dst); }
+static void jit_slot3(int dim, pixel *src, pixel *dst) { jit_run(3, dim, src, dst); }
+
+static const lab_test_func jit_slot_funcs[JIT_SLOTS] = {jit_slot0, jit_slot1, jit_slot2, jit_slot3};
+
+/*
+ * jit_compile_convolve - Returns a convolve function for *ker, which
+ *     may be passed to add_convolve_function(). Compiling the same
+ *     taps twice returns the same function. There are only JIT_SLOTS
+ *     compiled kernels at a time: once they are all taken by other
+ *     kernels this returns NULL until one is given back with
+ *     jit_release(), and the caller should convolve some other way.
+ */
+lab_test_func jit_compile_convolve(Kernel *ker)
+{
+    int n, ii, jj;
+    jit_kernel *jk;
+
+    for (n = 0; n < JIT_SLOTS; n++)
+        if (jit_slots[n].used && memcmp(jit_slots[n].taps, *ker, sizeof(jit_slots[n].taps)) == 0)
+            return jit_slot_funcs[n];
+    for (n = 0; n < JIT_SLOTS && jit_slots[n].used; n++)
+        ;
+    if (n == JIT_SLOTS)
+        return NULL;
+
+    jk = &jit_slots[n];
+    memcpy(jk->taps, *ker, sizeof(jk->taps));
+    jk->weight = 0.0f;
+    for (ii = 0; ii < 5; ii++)
+        for (jj = 0; jj < 5; jj++)
+            jk->weight += jk->taps[ii][jj];
+    jit_build(jk);
+    jk->used = 1;
+    return jit_slot_funcs[n];
+}
+
+/*
+ * jit_release - Gives back the slot of a function returned by
+ *     jit_compile_convolve(), which must not be called again. NULL
+ *     is ignored.
+ */
+void jit_release(lab_test_func f)
+{
+    int n;
+
+    for (n = 0; n < JIT_SLOTS; n++)
+        if (jit_slots[n].used && jit_slot_funcs[n] == f) {
+            if (jit_slots[n].code)
+                munmap(jit_slots[n].code, JIT_CODE_SIZE);
+            jit_slots[n].code = NULL;
+            jit_slots[n].row = NULL;
+            jit_slots[n].used = 0;
+        }
+}
+
+static lab_test_func jit_active;
+
+/*
+ * jit_convolve - Compiles the active kernel on first use and runs it.
+ *     When the kernel changes the old one's slot is released first,
+ *     so this never holds more than one.
+ */
+char jit_convolve_descr[] = "jit_convolve: Runtime-generated AVX2 code for the active kernel";
+void jit_convolve(int dim, pixel *src, pixel *dst)
+{
+    int n;
+
+    for (n = 0; n < JIT_SLOTS; n++)
+        if (jit_slots[n].used && jit_slot_funcs[n] == jit_active &&
+            memcmp(jit_slots[n].taps, kernel, sizeof(jit_slots[n].taps)) != 0) {
+            jit_release(jit_active);
+            jit_active = NULL;
+        }
+    if (!jit_active)
+        jit_active = jit_compile_convolve((Kernel *)&kernel);
+
+    if (jit_active)
+        jit_active(dim, src, dst);
+    else
+        simd_convolve(dim, src, dst);
+}
+
+/***************************************************************
+ * Register-blocked convolve. Neighbouring outputs share 20 of
+ * their 25 source pixels, so outputs are computed in strips of
+ * STRIP pixels: each row of a strip's window (STRIP+4 pixels) is
+ * loaded and converted to float once and fed to every output in
+ * the strip that needs it, about 5*(STRIP+4) conversions per strip
+ * instead of 25*STRIP. Taps are still applied row by row in
+ * check_convolution() order, so any kernel stays bit-exact.
+ **************************************************************/
+
+#define STRIP 8
+
+/*
+ * strip_convolve_row - Interior pixels of interior row i, STRIP at
+ *     a time; the last strip of the row may be narrower
+ */
+static void strip_convolve_row(int dim, const pixel *src, pixel *dst,
+                               const kernel_plan *kp, int i)
+{
+    const border_norm *n = &kp->norm[2][2];
+    pixel_sum acc[STRIP];
+    float r[STRIP+4], g[STRIP+4], b[STRIP+4];
+    int j, s, w, ii;
+
+    for (j = 2; j < dim - 2; j += STRIP) {
+        w = dim - 2 - j < STRIP ? dim - 2 - j : STRIP;
+        for (s = 0; s < w; s++)
+            acc[s].red = acc[s].green = acc[s].blue = 0.0f;
+
+        for (ii = 0; ii < 5; ii++) {
+            const pixel *row = &src[RIDX(i+ii-2, j-2, dim)];
+            const float *k = kp->taps[ii];
+
+            for (s = 0; s < w + 4; s++) {
+                r[s] = row[s].red;
+                g[s] = row[s].green;
+                b[s] = row[s].blue;
+            }
+            for (s = 0; s < w; s++) {
+                acc[s].red = acc[s].red + r[s] * k[0] + r[s+1] * k[1] + r[s+2] * k[2] +
+                    r[s+3] * k[3] + r[s+4] * k[4];
+                acc[s].green = acc[s].green + g[s] * k[0] + g[s+1] * k[1] + g[s+2] * k[2] +
+                    g[s+3] * k[3] + g[s+4] * k[4];
+                acc[s].blue = acc[s].blue + b[s] * k[0] + b[s+1] * k[1] + b[s+2] * k[2] +
+                    b[s+3] * k[3] + b[s+4] * k[4];
+            }
+        }
+
+        for (s = 0; s < w; s++) {
+            dst[RIDX(i,j+s,dim)].red   = normalize(acc[s].red, n, kp->exact);
+            dst[RIDX(i,j+s,dim)].green = normalize(acc[s].green, n, kp->exact);
+            dst[RIDX(i,j+s,dim)].blue  = normalize(acc[s].blue, n, kp->exact);
+        }
+    }
+}
+
+/*
+ * strip_convolve - Strips for the interior, the checked path for
+ *     the 2-pixel frame
+ */
+char strip_convolve_descr[] = "strip_convolve: Register-blocked strips, src loaded once per strip";
+void strip_convolve(int dim, pixel *src, pixel *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+    int i;
+
+    convolve_border_frame(dim, src, dst, kp, 0, dim);
+    for (i = 2; i < dim - 2; i++)
+        strip_convolve_row(dim, src, dst, kp, i);
+}
+
+/***************************************************************
+ * Line-buffered convolve. Source rows are converted to float once,
+ * into a ring of 5 lines, and each output row is computed from the
+ * ring alone, so src is streamed through the cache exactly once
+ * however large dim gets. Lines carry 2 pixels of zeros on each
+ * side and rows off the image read a line of zeros: adding 0*tap
+ * leaves a float sum unchanged, so the inner loop needs no bounds
+ * checks and still matches check_convolution() bit for bit.
+ **************************************************************/
+
+#define LINE_PAD 6      /* floats of zero padding on each side of a line */
+
+static float *line_ring = NULL;  /* 5 ring lines followed by a zero line */
+static int line_ring_dim = 0;
+static int line_stride = 0;      /* floats per line, a multiple of 16 */
+
+/*
+ * line_ring_alloc - Makes the ring big enough for dim. Returns 0 if
+ *     memory runs out.
+ */
+static int line_ring_alloc(int dim)
+{
+    if (dim <= line_ring_dim)
+        return 1;
+    free(line_ring);
+    line_stride = (3 * dim + 2 * LINE_PAD + 15) & ~15;
+    line_ring = aligned_alloc(64, 6 * (size_t)line_stride * sizeof(float));
+    line_ring_dim = line_ring ? dim : 0;
+    if (line_ring)
+        memset(line_ring, 0, 6 * (size_t)line_stride * sizeof(float));
+    return line_ring != NULL;
+}
+
+/*
+ * load_line - Converts one source row into a ring line. The ring may
+ *     have been sized for a wider image, so the right-hand padding is
+ *     cleared each time.
+ */
+__attribute__((target("avx2")))
+static void load_line_avx2(const unsigned short *s, float *line, int n)
+{
+    int x;
+
+    for (x = 0; x + 8 <= n; x += 8)
+        _mm256_storeu_ps(line + x, LOAD8_PS(s + x));
+    for (; x < n; x++)
+        line[x] = s[x];
+}
+
+static void load_line(const pixel *src_row, float *line, int dim)
+{
+    const unsigned short *s = (const unsigned short *)src_row;
+    int x;
+
+    if (__builtin_cpu_supports("avx2"))
+        load_line_avx2(s, line, 3 * dim);
+    else
+        for (x = 0; x < 3 * dim; x++)
+            line[x] = s[x];
+    memset(line + 3 * dim, 0, LINE_PAD * sizeof(float));
+}
+
+/*
+ * line_row_avx2 - Flat elements [x0, x1) of one output row from the 5
+ *     lines in rows[], all with the same weight
+ */
+__attribute__((target("avx2")))
+static void line_row_avx2(const float *const *rows, const float (*taps)[5],
+                          unsigned short *out, int x0, int x1, float weight)
+{
+    int ii, jj, x = x0;
+    const __m256 w = _mm256_set1_ps(weight);
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+
+    for (; x + 16 <= x1; x += 16) {
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+        for (ii = 0; ii < 5; ii++) {
+            const float *p = rows[ii] + x - 6;
+            for (jj = 0; jj < 5; jj++, p += 3) {
+                __m256 k = _mm256_broadcast_ss(&taps[ii][jj]);
+                a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(p), k));
+                a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(p + 8), k));
+            }
+        }
+        __m256i q = _mm256_packus_epi32(
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a0, w)), low16),
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a1, w)), low16));
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_permute4x64_epi64(q, 0xD8));
+    }
+    for (; x < x1; x++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += rows[ii][x + 3*(jj-2)] * taps[ii][jj];
+        out[x] = (unsigned short)(sum/weight);
+    }
+}
+
+/*
+ * line_row_scalar - Flat elements [x0, x1) of one output row with
+ *     kp's taps, each normalized by its own border class (or by
+ *     weight when by_class is 0)
+ */
+static void line_row_scalar(const float *const *rows, const kernel_plan *kp,
+                            unsigned short *out, int x0, int x1, float weight,
+                            int by_class, int width, int height, int i)
+{
+    int ii, jj, x;
+    border_norm scratch;
+
+    for (x = x0; x < x1; x++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += rows[ii][x + 3*(jj-2)] * kp->taps[ii][jj];
+        if (by_class)
+            out[x] = normalize(sum, lookup_norm_rect(kp, width, height, i, x / 3, &scratch),
+                               kp->exact);
+        else
+            out[x] = (unsigned short)(sum/weight);
+    }
+}
+
+/* Called once per output row i with the 5 ring lines around it */
+typedef void (*line_row_func)(int dim, int i, const float *const *rows, void *arg);
+
+/* Converts source row r into a ring line */
+typedef void (*line_load_func)(int dim, int r, float *line, void *src);
+
+static void line_load_pixels(int dim, int r, float *line, void *src)
+{
+    load_line(&((const pixel *)src)[RIDX(r, 0, dim)], line, dim);
+}
+
+/*
+ * line_stream_from - Streams the height rows of a width-pixel image
+ *     from load through the ring of 5 float lines, one source row read
+ *     per output row, in order. load and fn are passed width as dim.
+ *     Returns 0 if memory runs out.
+ */
+static int line_stream_from(int width, int height, line_load_func load, void *src,
+                            line_row_func fn, void *arg)
+{
+    const float *zero_line;
+    int i, ii, next;
+
+    if (!line_ring_alloc(width))
+        return 0;
+    zero_line = line_ring + 5 * line_stride + LINE_PAD;
+
+    for (next = 0; next < 2 && next < height; next++)
+        load(width, next, line_ring + (next % 5) * line_stride + LINE_PAD, src);
+
+    for (i = 0; i < height; i++) {
+        const float *rows[5];
+
+        if (next < height) {
+            load(width, next, line_ring + (next % 5) * line_stride + LINE_PAD, src);
+            next++;
+        }
+        for (ii = 0; ii < 5; ii++)
+            rows[ii] = (i + ii - 2 >= 0 && i + ii - 2 < height) ?
+                line_ring + ((i + ii - 2) % 5) * line_stride + LINE_PAD : zero_line;
+        fn(width, i, rows, arg);
+    }
+    return 1;
+}
+
+/*
+ * line_stream - Streams src through the ring of 5 float lines
+ */
+static int line_stream(int dim, const pixel *src, line_row_func fn, void *arg)
+{
+    return line_stream_from(dim, dim, line_load_pixels, (void *)src, fn, arg);
+}
+
+/* Flat elements per slice of a row shared by all kernels of a batch */
+#define LINE_CHUNK 256
+
+typedef struct {
+    const kernel_plan *const *kps;
+    pixel *const *dsts;
+    int count;
+    int height;          /* image height; the width comes in as dim */
+    int stride;          /* pixels between dst rows */
+} line_batch;
+
+/*
+ * line_kernels_row - Output row i of a width x height image for count
+ *     kernels, kernel k's row going to outs[k]. The interior goes in
+ *     LINE_CHUNK slices with all kernels applied to a slice while its
+ *     part of the ring is still in L1.
+ */
+static void line_kernels_row(const float *const *rows, const kernel_plan *const *kps,
+                             pixel *const *outs, int count, int width, int height, int i)
+{
+    int table = width >= 5 && height >= 5;
+    int lo = table ? 6 : 3 * width;
+    int hi = table ? 3 * width - 6 : 3 * width;
+    int avx2 = __builtin_cpu_supports("avx2");
+    int k, x, end;
+
+    for (k = 0; k < count; k++) {
+        unsigned short *out = (unsigned short *)outs[k];
+        line_row_scalar(rows, kps[k], out, 0, lo, 0.0f, 1, width, height, i);
+        line_row_scalar(rows, kps[k], out, hi > lo ? hi : lo, 3 * width, 0.0f, 1,
+                        width, height, i);
+    }
+    for (x = lo; x < hi; x = end) {
+        end = hi - x < LINE_CHUNK ? hi : x + LINE_CHUNK;
+        for (k = 0; k < count; k++) {
+            const kernel_plan *kp = kps[k];
+            unsigned short *out = (unsigned short *)outs[k];
+            float weight = kp->norm[edge_class(i, height)][2].weight;
+            if (avx2)
+                line_row_avx2(rows, (const float (*)[5])kp->taps, out, x, end, weight);
+            else
+                line_row_scalar(rows, kp, out, x, end, weight, 0, width, height, i);
+        }
+    }
+}
+
+/*
+ * line_emit_row - Output row i of kernel kp into out, which holds one
+ *     row of width pixels. For consumers that take rows one at a time
+ *     rather than into an image.
+ */
+static void line_emit_row(const float *const *rows, const kernel_plan *kp, pixel *out,
+                          int width, int height, int i)
+{
+    line_kernels_row(rows, &kp, &out, 1, width, height, i);
+}
+
+/* Kernels per line_kernels_row() call from line_batch_row() */
+#define LINE_BATCH_MAX 16
+
+/*
+ * line_batch_row - Row i for every kernel of the batch, into row i of
+ *     each dst image
+ */
+static void line_batch_row(int dim, int i, const float *const *rows, void *arg)
+{
+    const line_batch *b = arg;
+    pixel *outs[LINE_BATCH_MAX];
+    int k0, k;
+
+    for (k0 = 0; k0 < b->count; k0 += LINE_BATCH_MAX) {
+        int n = b->count - k0 < LINE_BATCH_MAX ? b->count - k0 : LINE_BATCH_MAX;
+        for (k = 0; k < n; k++)
+            outs[k] = &b->dsts[k0 + k][RIDX(i, 0, b->stride)];
+        line_kernels_row(rows, &b->kps[k0], outs, n, dim, b->height, i);
+    }
+}
+
+/*
+ * line_convolve - Streams src through a ring of 5 float lines and
+ *     writes one output row per source row read
+ */
+char line_convolve_descr[] = "line_convolve: Rolling 5-line buffer, src read once";
+void line_convolve(int dim, pixel *src, pixel *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+    line_batch b = {&kp, &dst, 1, dim, dim};
+
+    if (!line_stream(dim, src, line_batch_row, &b))
+        simd_convolve(dim, src, dst);
+}
+
+/*
+ * convolve_batch - Applies count kernels to src in one pass: dsts[k]
+ *     gets kernel ks[k], exactly as convolve() would compute it. Each
+ *     source row is converted once for all of them. Returns -1 if
+ *     memory runs out.
+ */
+int convolve_batch(int dim, Kernel *const *ks, int count, pixel *src, pixel *const *dsts)
+{
+    kernel_plan *plans = malloc(count * sizeof(kernel_plan));
+    const kernel_plan **kps = malloc(count * sizeof(kernel_plan *));
+    line_batch b = {kps, dsts, count, dim, dim};
+    int k, ret = -1;
+
+    if (plans && kps) {
+        for (k = 0; k < count; k++) {
+            build_plan(&plans[k], *ks[k]);
+            kps[k] = &plans[k];
+        }
+        if (line_stream(dim, src, line_batch_row, &b))
+            ret = 0;
+    }
+    free(plans);
+    free(kps);
+    return ret;
+}
+
+typedef struct {
+    const kernel_plan *gx, *gy;
+    pixel *dst;
+} line_gradient;
+
+/*
+ * gradient_value - sqrt(gx^2 + gy^2) of the normalized responses,
+ *     saturated to a channel; a response with weight 0 counts as 0
+ */
+static inline unsigned short gradient_value(float sx, float wx, float sy, float wy)
+{
+    float qx = wx != 0.0f ? sx / wx : 0.0f;
+    float qy = wy != 0.0f ? sy / wy : 0.0f;
+    float m = sqrtf(qx * qx + qy * qy);
+
+    return m >= CHANNEL_MAX ? 65535 : (unsigned short)m;
+}
+
+/*
+ * line_gradient_avx2 - Interior flat elements [x0, x1) of a gradient
+ *     row, both kernels summed from the same loads
+ */
+__attribute__((target("avx2")))
+static void line_gradient_avx2(const float *const *rows, const line_gradient *g,
+                               unsigned short *out, int x0, int x1, float wx, float wy)
+{
+    int ii, jj, x = x0;
+    const __m256 vwx = _mm256_set1_ps(wx != 0.0f ? wx : 1.0f);
+    const __m256 vwy = _mm256_set1_ps(wy != 0.0f ? wy : 1.0f);
+    const __m256 zx = _mm256_castsi256_ps(_mm256_set1_epi32(wx != 0.0f ? -1 : 0));
+    const __m256 zy = _mm256_castsi256_ps(_mm256_set1_epi32(wy != 0.0f ? -1 : 0));
+    const __m256 cmax = _mm256_set1_ps(CHANNEL_MAX);
+
+    for (; x + 8 <= x1; x += 8) {
+        __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps();
+        for (ii = 0; ii < 5; ii++) {
+            const float *p = rows[ii] + x - 6;
+            for (jj = 0; jj < 5; jj++, p += 3) {
+                __m256 v = _mm256_loadu_ps(p);
+                sx = _mm256_add_ps(sx, _mm256_mul_ps(v, _mm256_broadcast_ss(&g->gx->taps[ii][jj])));
+                sy = _mm256_add_ps(sy, _mm256_mul_ps(v, _mm256_broadcast_ss(&g->gy->taps[ii][jj])));
+            }
+        }
+        __m256 qx = _mm256_and_ps(_mm256_div_ps(sx, vwx), zx);
+        __m256 qy = _mm256_and_ps(_mm256_div_ps(sy, vwy), zy);
+        __m256 m = _mm256_min_ps(_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(qx, qx),
+                                                              _mm256_mul_ps(qy, qy))), cmax);
+        __m256i q = _mm256_cvttps_epi32(m);
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(q),
+                                          _mm256_extracti128_si256(q, 1));
+        _mm_storeu_si128((__m128i *)(out + x), packed);
+    }
+    for (; x < x1; x++) {
+        float sx = 0.0f, sy = 0.0f;
+        for (ii = 0; ii < 5; ii++) {
+            for (jj = 0; jj < 5; jj++) {
+                sx += rows[ii][x + 3*(jj-2)] * g->gx->taps[ii][jj];
+                sy += rows[ii][x + 3*(jj-2)] * g->gy->taps[ii][jj];
+            }
+        }
+        out[x] = gradient_value(sx, wx, sy, wy);
+    }
+}
+
+/*
+ * line_gradient_scalar - Flat elements [x0, x1) of a gradient row,
+ *     each normalized by its own border class
+ */
+static void line_gradient_scalar(const float *const *rows, const line_gradient *g,
+                                 unsigned short *out, int x0, int x1, int dim, int i)
+{
+    int ii, jj, x;
+    border_norm xs, ys;
+
+    for (x = x0; x < x1; x++) {
+        float sx = 0.0f, sy = 0.0f;
+        for (ii = 0; ii < 5; ii++) {
+            for (jj = 0; jj < 5; jj++) {
+                sx += rows[ii][x + 3*(jj-2)] * g->gx->taps[ii][jj];
+                sy += rows[ii][x + 3*(jj-2)] * g->gy->taps[ii][jj];
+            }
+        }
+        out[x] = gradient_value(sx, lookup_norm(g->gx, dim, i, x / 3, &xs)->weight,
+                                sy, lookup_norm(g->gy, dim, i, x / 3, &ys)->weight);
+    }
+}
+
+/*
+ * line_gradient_row - Row i of the gradient magnitude image
+ */
+static void line_gradient_row(int dim, int i, const float *const *rows, void *arg)
+{
+    const line_gradient *g = arg;
+    unsigned short *out = (unsigned short *)&g->dst[RIDX(i, 0, dim)];
+    int lo = dim >= 5 ? 6 : 3 * dim;
+    int hi = dim >= 5 ? 3 * dim - 6 : 3 * dim;
+
+    line_gradient_scalar(rows, g, out, 0, lo, dim, i);
+    if (lo < hi && __builtin_cpu_supports("avx2"))
+        line_gradient_avx2(rows, g, out, lo, hi, g->gx->norm[edge_class(i, dim)][2].weight,
+                           g->gy->norm[edge_class(i, dim)][2].weight);
+    else
+        line_gradient_scalar(rows, g, out, lo, hi, dim, i);
+    line_gradient_scalar(rows, g, out, hi > lo ? hi : lo, 3 * dim, dim, i);
+}
+
+/*
+ * convolve_gradient - Gradient magnitude of src: each channel of dst
+ *     is sqrt(gx^2 + gy^2) of what convolve() would give with kernels
+ *     kx and ky (before truncation), saturated at 65535. The two
+ *     responses are never stored. Returns -1 if memory runs out.
+ */
+int convolve_gradient(int dim, Kernel *kx, Kernel *ky, pixel *src, pixel *dst)
+{
+    kernel_plan px, py;
+    line_gradient g = {&px, &py, dst};
+
+    build_plan(&px, *kx);
+    build_plan(&py, *ky);
+    return line_stream(dim, src, line_gradient_row, &g) ? 0 : -1;
+}
+
+/***************************************************************
+ * Planar convolve. Each plane is its own flat array, so the taps
+ * of a row sit 1 element apart instead of 3 and the vector loop
+ * works on one channel at a time.
+ **************************************************************/
+
+/*
+ * plane_pixel_checked - One output value of a plane with bounds
+ *     checks, in check_convolution() order
+ */
+static unsigned short plane_pixel_checked(int dim, const unsigned short *src, int i, int j,
+                                          const kernel_plan *kp)
+{
+    int ii, jj;
+    float sum = 0.0f;
+    border_norm scratch;
+
+    for (ii = i - 2; ii <= i + 2; ii++) {
+        if (ii < 0 || ii >= dim)
+            continue;
+        for (jj = j - 2; jj <= j + 2; jj++) {
+            if (jj < 0 || jj >= dim)
+                continue;
+            sum += src[RIDX(ii,jj,dim)] * kernel[ii-i+2][jj-j+2];
+        }
+    }
+    return normalize(sum, lookup_norm(kp, dim, i, j, &scratch), kp->exact);
+}
+
+/*
+ * plane_row_avx2 - Columns [2, dim-2) of interior row i of one plane
+ */
+__attribute__((target("avx2")))
+static void plane_row_avx2(int dim, const unsigned short *src, unsigned short *dst,
+                           int i, float weight)
+{
+    int ii, jj, j;
+    const unsigned short *s = &src[RIDX(i-2, 0, dim)];
+    unsigned short *out = &dst[RIDX(i, 0, dim)];
+    const __m256 w = _mm256_set1_ps(weight);
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+
+    for (j = 2; j + 16 <= dim - 2; j += 16) {
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+        for (ii = 0; ii < 5; ii++) {
+            const unsigned short *p = s + ii*dim + j - 2;
+            for (jj = 0; jj < 5; jj++, p++) {
+                __m256 k = _mm256_broadcast_ss(&kernel[ii][jj]);
+                a0 = _mm256_add_ps(a0, _mm256_mul_ps(LOAD8_PS(p), k));
+                a1 = _mm256_add_ps(a1, _mm256_mul_ps(LOAD8_PS(p + 8), k));
+            }
+        }
+        __m256i q = _mm256_packus_epi32(
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a0, w)), low16),
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a1, w)), low16));
+        _mm256_storeu_si256((__m256i *)(out + j), _mm256_permute4x64_epi64(q, 0xD8));
+    }
+    for (; j < dim - 2; j++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += s[ii*dim + j + jj - 2] * kernel[ii][jj];
+        out[j] = (unsigned short)(sum/weight);
+    }
+}
+
+/*
+ * convolve_plane - Convolves one dim x dim plane
+ */
+static void convolve_plane(int dim, const unsigned short *src, unsigned short *dst,
+                           const kernel_plan *kp)
+{
+    int i, j;
+    int avx2 = __builtin_cpu_supports("avx2");
+
+    for (i = 0; i < dim; i++) {
+        if (i < 2 || i >= dim - 2 || dim < 5 || !avx2) {
+            for (j = 0; j < dim; j++)
+                dst[RIDX(i,j,dim)] = plane_pixel_checked(dim, src, i, j, kp);
+            continue;
+        }
+        plane_row_avx2(dim, src, dst, i, kp->norm[2][2].weight);
+        dst[RIDX(i,0,dim)] = plane_pixel_checked(dim, src, i, 0, kp);
+        dst[RIDX(i,1,dim)] = plane_pixel_checked(dim, src, i, 1, kp);
+        dst[RIDX(i,dim-2,dim)] = plane_pixel_checked(dim, src, i, dim - 2, kp);
+        dst[RIDX(i,dim-1,dim)] = plane_pixel_checked(dim, src, i, dim - 1, kp);
+    }
+}
+
+/*
+ * planar_convolve - Convolves each plane of src with the current kernel
+ */
+void planar_convolve(const planar_image *src, planar_image *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+
+    convolve_plane(src->dim, src->red, dst->red, kp);
+    convolve_plane(src->dim, src->green, dst->green, kp);
+    convolve_plane(src->dim, src->blue, dst->blue, kp);
+}
+
+/*
+ * planar_convolve_pixels - planar_convolve() with conversions at both
+ *     ends, so the driver can check and time it
+ */
+char planar_convolve_descr[] = "planar_convolve: Per-plane AVX2 plus AoS<->SoA conversion";
+void planar_convolve_pixels(int dim, pixel *src, pixel *dst)
+{
+    if (!planar_scratch(dim)) {
+        simd_convolve(dim, src, dst);
+        return;
+    }
+    pixels_to_planar(dim, src, &planar_in);
+    planar_convolve(&planar_in, &planar_out);
+    planar_to_pixels(dim, &planar_out, dst);
+}
+
+/***************************************************************
+ * Fused flip + convolve. convolve() of the flipped image reads,
+ * for the output at F(p), the flipped image around F(p). Every
+ * RIDX_F mapping is a symmetry of the square, so that is src
+ * around p with each tap moved to a remapped offset. Taps keep
+ * their place in check_convolution() order, so the result is
+ * bit-exact with flip followed by convolve for any kernel, and
+ * the intermediate image is never written.
+ **************************************************************/
+
+#define FUSED_BAND 32    /* output rows computed before they are scattered */
+
+typedef struct {
+    int di, dj;         /* offset of the tap in src */
+    float k;
+} fused_tap;
+
+/*
+ * fused_taps - The kernel's taps in check_convolution() order with
+ *     their src offsets. A step of (a, b) in the flipped image is
+ *     a*dim + b in dst, which src reaches through whichever of its
+ *     row and column steps is +-dim and which is +-1.
+ */
+static void fused_taps(int dim, const kernel_plan *kp, fused_tap *t)
+{
+    long o, di, dj;
+    int a, b, si, sj;
+
+    flip_affine(dim, &o, &di, &dj);
+    si = di > 0 ? 1 : -1;
+    sj = dj > 0 ? 1 : -1;
+    for (a = -2; a <= 2; a++) {
+        for (b = -2; b <= 2; b++, t++) {
+            if (di == dim || di == -dim) {
+                t->di = a * si;
+                t->dj = b * sj;
+            }
+            else {
+                t->di = b * si;
+                t->dj = a * sj;
+            }
+            t->k = kp->taps[a+2][b+2];
+        }
+    }
+}
+
+typedef struct {
+    const kernel_plan *kp;
+    int n;              /* nonzero taps, in check_convolution() order */
+    int line[25];       /* ring line of each tap, 0..4 */
+    int off[25];        /* flat offset of each tap within its line */
+    float k[25];
+    long o, di, dj;     /* flip_affine() of the mapping */
+    pixel *dst;
+} fused_job;
+
+static unsigned short *fused_band = NULL;
+static int fused_band_dim = 0;
+
+/*
+ * fused_row_avx2 - Flat elements [x0, x1) of an output row whose
+ *     destinations all have the same weight
+ */
+__attribute__((target("avx2")))
+static void fused_row_avx2(const float *const *rows, const fused_job *f,
+                           unsigned short *out, int x0, int x1, float weight)
+{
+    const __m256 w = _mm256_set1_ps(weight);
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    int x = x0, t;
+
+    for (; x + 16 <= x1; x += 16) {
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+        for (t = 0; t < f->n; t++) {
+            const float *p = rows[f->line[t]] + x + f->off[t];
+            __m256 k = _mm256_broadcast_ss(&f->k[t]);
+            a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(p), k));
+            a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(p + 8), k));
+        }
+        __m256i q = _mm256_packus_epi32(
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a0, w)), low16),
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a1, w)), low16));
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_permute4x64_epi64(q, 0xD8));
+    }
+    for (; x < x1; x++) {
+        float sum = 0.0f;
+        for (t = 0; t < f->n; t++)
+            sum += rows[f->line[t]][x + f->off[t]] * f->k[t];
+        out[x] = (unsigned short)(sum/weight);
+    }
+}
+
+/*
+ * fused_row_scalar - Flat elements [x0, x1) of output row i, each
+ *     normalized by the border class of its destination
+ */
+static void fused_row_scalar(const float *const *rows, const fused_job *f,
+                             unsigned short *out, int x0, int x1, int dim, int i)
+{
+    border_norm scratch;
+    int x, t;
+    long q;
+
+    for (x = x0; x < x1; x++) {
+        float sum = 0.0f;
+        for (t = 0; t < f->n; t++)
+            sum += rows[f->line[t]][x + f->off[t]] * f->k[t];
+        q = f->o + i * f->di + (x / 3) * f->dj;
+        out[x] = normalize(sum, lookup_norm(f->kp, dim, q / dim, q % dim, &scratch),
+                           f->kp->exact);
+    }
+}
+
+/*
+ * fused_scatter - Writes band rows [i0, i1] to their flipped positions
+ *     in FUSED_BAND-wide column blocks, so a rotate touches at most
+ *     FUSED_BAND lines of dst at a time
+ */
+static void fused_scatter(int dim, const fused_job *f, int i0, int i1)
+{
+    int i, j, tj, jend;
+
+    for (tj = 0; tj < dim; tj += FUSED_BAND) {
+        jend = tj + FUSED_BAND < dim ? tj + FUSED_BAND : dim;
+        for (i = i0; i <= i1; i++) {
+            const pixel *b = (const pixel *)&fused_band[(i % FUSED_BAND) * 3 * (size_t)dim];
+            pixel *d = f->dst + f->o + i * f->di;
+            for (j = tj; j < jend; j++)
+                d[j * f->dj] = b[j];
+        }
+    }
+}
+
+/*
+ * fused_row - Computes output row i into the band and scatters the
+ *     band once it is full
+ */
+static void fused_row(int dim, int i, const float *const *rows, void *arg)
+{
+    const fused_job *f = arg;
+    unsigned short *out = &fused_band[(i % FUSED_BAND) * 3 * (size_t)dim];
+
+    if (i < 2 || i >= dim - 2 || dim < 5)
+        fused_row_scalar(rows, f, out, 0, 3 * dim, dim, i);
+    else {
+        fused_row_scalar(rows, f, out, 0, 6, dim, i);
+        if (__builtin_cpu_supports("avx2"))
+            fused_row_avx2(rows, f, out, 6, 3 * dim - 6, f->kp->norm[2][2].weight);
+        else
+            fused_row_scalar(rows, f, out, 6, 3 * dim - 6, dim, i);
+        fused_row_scalar(rows, f, out, 3 * dim - 6, 3 * dim, dim, i);
+    }
+    if (i % FUSED_BAND == FUSED_BAND - 1 || i == dim - 1)
+        fused_scatter(dim, f, i - i % FUSED_BAND, i);
+}
+
+/*
+ * flip_convolve - dst = convolve(flip(src)) for the team's RIDX_F
+ *     mapping. Src streams through the line ring once; output rows
+ *     are computed with the remapped taps into a band of FUSED_BAND
+ *     rows, which is flipped into dst while it is still in cache.
+ */
+void flip_convolve(int dim, pixel *src, pixel *dst)
+{
+    fused_tap t[25];
+    fused_job f;
+    int x;
+
+    f.kp = get_kernel_plan();
+    f.dst = dst;
+    f.n = 0;
+    flip_affine(dim, &f.o, &f.di, &f.dj);
+    fused_taps(dim, f.kp, t);
+    for (x = 0; x < 25; x++) {
+        if (t[x].k == 0.0f)
+            continue;
+        f.line[f.n] = t[x].di + 2;
+        f.off[f.n] = 3 * t[x].dj;
+        f.k[f.n++] = t[x].k;
+    }
+
+    if (dim > fused_band_dim) {
+        free(fused_band);
+        fused_band = malloc(FUSED_BAND * 3 * (size_t)dim * sizeof(unsigned short));
+        fused_band_dim = fused_band ? dim : 0;
+    }
+    if (!fused_band || !line_stream(dim, src, fused_row, &f)) {
+        /* out of memory: two passes through a scratch image */
+        pixel *tmp = malloc((size_t)dim * dim * sizeof(pixel));
+        int i, j;
+        if (!tmp)
+            return;
+        for (i = 0; i < dim; i++)
+            for (j = 0; j < dim; j++)
+                tmp[RIDX_F(i, j, dim)] = src[RIDX(i, j, dim)];
+        convolve(dim, tmp, dst);
+        free(tmp);
+    }
+}
+
+/***************************************************************
+ * Convolving through a flipped view. The line buffer asks for
+ * source rows in order, so view rows are fetched VIEW_BAND at a
+ * time with flip_view_rows() and the flipped image never exists
+ * in full.
+ **************************************************************/
+
+typedef struct {
+    const flip_view *v;
+    pixel *band;         /* VIEW_BAND view rows */
+    int band0;           /* first view row in band, or -1 */
+} view_source;
+
+static void line_load_view(int dim, int r, float *line, void *src)
+{
+    view_source *vs = src;
+
+    if (vs->band0 < 0 || r >= vs->band0 + VIEW_BAND) {
+        vs->band0 = r;
+        flip_view_rows(vs->v, r, dim - r < VIEW_BAND ? dim - r : VIEW_BAND, vs->band);
+    }
+    load_line(&vs->band[RIDX(r - vs->band0, 0, dim)], line, dim);
+}
+
+/*
+ * convolve_view - dst = convolve() of the view, read through the view
+ *     without materializing it (unless it already was). Returns -1 if
+ *     memory runs out.
+ */
+int convolve_view(const flip_view *v, pixel *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+    line_batch b = {&kp, &dst, 1, v->dim, v->dim};
+    view_source vs = {v, NULL, -1};
+    int ok;
+
+    if (v->copy || v->t == FLIP_IDENTITY)
+        return line_stream(v->dim, v->copy ? v->copy : v->src, line_batch_row, &b) ? 0 : -1;
+    vs.band = malloc((size_t)VIEW_BAND * v->dim * sizeof(pixel));
+    if (!vs.band)
+        return -1;
+    ok = line_stream_from(v->dim, v->dim, line_load_view, &vs, line_batch_row, &b);
+    free(vs.band);
+    return ok ? 0 : -1;
+}
+
+/***************************************************************
+ * Rectangular convolve. The line buffer only needs rows in order,
+ * so a width x height image with strided rows streams through it
+ * the same way a square one does.
+ **************************************************************/
+
+typedef struct {
+    const pixel *src;
+    int stride;
+} strided_source;
+
+static void line_load_strided(int width, int r, float *line, void *src)
+{
+    const strided_source *s = src;
+
+    load_line(&s->src[RIDX(r, 0, s->stride)], line, width);
+}
+
+/*
+ * convolve_rect_checked - One pixel the slow way, with the bounds
+ *     checks of check_convolution(); used if the ring can't be had
+ */
+static pixel convolve_rect_checked(int width, int height, const pixel *src, int stride,
+                                   int i, int j)
+{
+    float sum0 = 0, sum1 = 0, sum2 = 0, weight = 0;
+    pixel p;
+    int ii, jj;
+
+    for (ii = i - 2; ii <= i + 2; ii++)
+        for (jj = j - 2; jj <= j + 2; jj++) {
+            const pixel *s;
+            float k;
+            if (ii < 0 || ii >= height || jj < 0 || jj >= width)
+                continue;
+            s = &src[RIDX(ii, jj, stride)];
+            k = kernel[ii-i+2][jj-j+2];
+            sum0 += s->red * k;
+            sum1 += s->green * k;
+            sum2 += s->blue * k;
+            weight += k;
+        }
+    p.red = (unsigned short)(sum0/weight);
+    p.green = (unsigned short)(sum1/weight);
+    p.blue = (unsigned short)(sum2/weight);
+    return p;
+}
+
+/*
+ * convolve_rect - convolve() of a width x height image whose rows are
+ *     src_stride pixels apart, into dst rows dst_stride apart
+ */
+char convolve_rect_descr[] = "convolve_rect: Rectangular, strided rows, line buffered";
+void convolve_rect(int width, int height, pixel *src, int src_stride,
+                   pixel *dst, int dst_stride)
+{
+    const kernel_plan *kp = get_kernel_plan();
+    line_batch b = {&kp, &dst, 1, height, dst_stride};
+    strided_source s = {src, src_stride};
+    int i, j;
+
+    if (line_stream_from(width, height, line_load_strided, &s, line_batch_row, &b))
+        return;
+    for (i = 0; i < height; i++)
+        for (j = 0; j < width; j++)
+            dst[RIDX(i, j, dst_stride)] = convolve_rect_checked(width, height, src,
+                                                                 src_stride, i, j);
+}
+
+/***************************************************************
+ * Pixel formats. Besides the lab's 48-bit pixel an image can be
+ * kept as 8-bit RGB, as 16-bit RGB padded to 8 bytes, or as three
+ * float planes. Flips are plain element moves in any format;
+ * convolve streams every format through the float line buffer and
+ * finishes each row in the destination format. 8-bit results keep
+ * the low byte of the truncated quotient, as the 16-bit ones keep
+ * the low 16 bits; float results are not truncated at all.
+ **************************************************************/
+
+/*
+ * format_pixel_bytes - Bytes one pixel takes in format f
+ */
+int format_pixel_bytes(pixel_format f)
+{
+    switch (f) {
+    case FMT_RGB24:        return sizeof(pixel24);
+    case FMT_RGBX64:       return sizeof(pixel64);
+    case FMT_FLOAT_PLANES: return 3 * sizeof(float);
+    default:               return sizeof(pixel);
+    }
+}
+
+/*
+ * format_name - Short name of format f, for reports
+ */
+const char *format_name(pixel_format f)
+{
+    switch (f) {
+    case FMT_RGB24:        return "rgb24";
+    case FMT_RGBX64:       return "rgbx64";
+    case FMT_FLOAT_PLANES: return "float planes";
+    default:               return "rgb48";
+    }
+}
+
+/*
+ * format_image_alloc - Allocates a dim x dim image in format f,
+ *     64-byte aligned. Returns 0 if memory runs out.
+ */
+int format_image_alloc(format_image *img, pixel_format f, int dim)
+{
+    size_t bytes = (size_t)dim * dim * format_pixel_bytes(f);
+
+    img->format = f;
+    img->dim = dim;
+    img->data = aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+    return img->data != NULL;
+}
+
+void format_image_free(format_image *img)
+{
+    free(img->data);
+    img->data = NULL;
+}
+
+/* The three planes of a FMT_FLOAT_PLANES image */
+#define FORMAT_PLANE(img, c) ((float *)(img)->data + (size_t)(c) * (img)->dim * (img)->dim)
+
+/*
+ * format_from_pixels - Converts dim x dim pixels into dst's format.
+ *     8-bit channels keep the high byte.
+ */
+void format_from_pixels(int dim, const pixel *src, format_image *dst)
+{
+    const unsigned short *s = (const unsigned short *)src;
+    long n = (long)dim * dim, x;
+
+    switch (dst->format) {
+    case FMT_RGB24: {
+        unsigned char *d = dst->data;
+        for (x = 0; x < 3 * n; x++)
+            d[x] = s[x] >> 8;
+        break;
+    }
+    case FMT_RGBX64: {
+        pixel64 *d = dst->data;
+        for (x = 0; x < n; x++) {
+            d[x].red = src[x].red;
+            d[x].green = src[x].green;
+            d[x].blue = src[x].blue;
+            d[x].pad = 0;
+        }
+        break;
+    }
+    case FMT_FLOAT_PLANES: {
+        float *r = FORMAT_PLANE(dst, 0), *g = FORMAT_PLANE(dst, 1), *b = FORMAT_PLANE(dst, 2);
+        for (x = 0; x < n; x++) {
+            r[x] = src[x].red;
+            g[x] = src[x].green;
+            b[x] = src[x].blue;
+        }
+        break;
+    }
+    default:
+        memcpy(dst->data, src, n * sizeof(pixel));
+    }
+}
+
+/*
+ * format_to_pixels - Converts src back to dim x dim pixels. 8-bit
+ *     channels are widened by 257 (0xAB -> 0xABAB); floats are
+ *     truncated like convolve() results.
+ */
+void format_to_pixels(int dim, const format_image *src, pixel *dst)
+{
+    unsigned short *d = (unsigned short *)dst;
+    long n = (long)dim * dim, x;
+
+    switch (src->format) {
+    case FMT_RGB24: {
+        const unsigned char *s = src->data;
+        for (x = 0; x < 3 * n; x++)
+            d[x] = s[x] * 257;
+        break;
+    }
+    case FMT_RGBX64: {
+        const pixel64 *s = src->data;
+        for (x = 0; x < n; x++) {
+            dst[x].red = s[x].red;
+            dst[x].green = s[x].green;
+            dst[x].blue = s[x].blue;
+        }
+        break;
+    }
+    case FMT_FLOAT_PLANES: {
+        const float *r = FORMAT_PLANE(src, 0), *g = FORMAT_PLANE(src, 1), *b = FORMAT_PLANE(src, 2);
+        for (x = 0; x < n; x++) {
+            dst[x].red = (unsigned short)r[x];
+            dst[x].green = (unsigned short)g[x];
+            dst[x].blue = (unsigned short)b[x];
+        }
+        break;
+    }
+    default:
+        memcpy(dst, src->data, n * sizeof(pixel));
+    }
+}
+
+/* Tile side for the format flips. Plane strides are powers of two
+   for the benchmark sizes, so tiles stay small to limit set conflicts. */
+#define FORMAT_FLIP_TILE 16
+
+/* Flip of dim x dim elements of one type by transform t. Mirrors go
+   row by row; the swapping transforms go in tiles, each walked along
+   dst rows so the writes are sequential. */
+#define DEFINE_FORMAT_FLIP(name, type)                                  \
+static void name(int dim, int t, const type *src, type *dst)            \
+{                                                                       \
+    long o, di, dj;                                                     \
+    int ti, tj, i, j, iend, jend;                                       \
+                                                                        \
+    transform_affine(t, dim, &o, &di, &dj);                             \
+    if (!(t & FLIP_SWAP)) {                                             \
+        for (i = 0; i < dim; i++) {                                     \
+            const type *s = &src[RIDX(i, 0, dim)];                      \
+            type *d = &dst[o + i * di];                                 \
+            for (j = 0; j < dim; j++)                                   \
+                d[j * dj] = s[j];                                       \
+        }                                                               \
+        return;                                                         \
+    }                                                                   \
+    for (ti = 0; ti < dim; ti += FORMAT_FLIP_TILE) {                    \
+        iend = ti + FORMAT_FLIP_TILE < dim ? ti + FORMAT_FLIP_TILE : dim; \
+        for (tj = 0; tj < dim; tj += FORMAT_FLIP_TILE) {                \
+            jend = tj + FORMAT_FLIP_TILE < dim ? tj + FORMAT_FLIP_TILE : dim; \
+            for (j = tj; j < jend; j++) {                               \
+                const type *s = &src[RIDX(0, j, dim)];                  \
+                type *d = &dst[o + j * dj];                             \
+                for (i = ti; i < iend; i++)                             \
+                    d[i * di] = s[(long)i * dim];                       \
+            }                                                           \
+        }                                                               \
+    }                                                                   \
+}
+
+DEFINE_FORMAT_FLIP(flip_rgb24, pixel24)
+DEFINE_FORMAT_FLIP(flip_rgbx64, pixel64)
+DEFINE_FORMAT_FLIP(flip_float_plane, float)
+
+/*
+ * format_flip - dst = src under the current mapping, in src's format
+ *     (dst must have the same format and size)
+ */
+void format_flip(const format_image *src, format_image *dst)
+{
+    int dim = src->dim, c;
+    int t = current_flip_transform();
+
+    if (t < 0)
+        t = FLIP_IDENTITY;
+    switch (src->format) {
+    case FMT_RGB24:
+        flip_rgb24(dim, t, src->data, dst->data);
+        break;
+    case FMT_RGBX64:
+        flip_rgbx64(dim, t, src->data, dst->data);
+        break;
+    case FMT_FLOAT_PLANES:
+        for (c = 0; c < 3; c++)
+            flip_float_plane(dim, t, FORMAT_PLANE(src, c), FORMAT_PLANE(dst, c));
+        break;
+    default:
+        spec_flips[t](dim, src->data, dst->data);
+    }
+}
+
+/*
+ * line_load_format - Converts row r of a format_image into a ring line
+ */
+static void line_load_format(int dim, int r, float *line, void *src)
+{
+    const format_image *img = src;
+    long base = (long)r * dim;
+    int j, x;
+
+    switch (img->format) {
+    case FMT_RGB24: {
+        const unsigned char *s = (const unsigned char *)img->data + 3 * base;
+        for (x = 0; x < 3 * dim; x++)
+            line[x] = s[x];
+        break;
+    }
+    case FMT_RGBX64: {
+        const pixel64 *s = (const pixel64 *)img->data + base;
+        for (j = 0; j < dim; j++) {
+            line[3*j] = s[j].red;
+            line[3*j+1] = s[j].green;
+            line[3*j+2] = s[j].blue;
+        }
+        break;
+    }
+    case FMT_FLOAT_PLANES: {
+        const float *pr = FORMAT_PLANE(img, 0) + base;
+        const float *pg = FORMAT_PLANE(img, 1) + base;
+        const float *pb = FORMAT_PLANE(img, 2) + base;
+        for (j = 0; j < dim; j++) {
+            line[3*j] = pr[j];
+            line[3*j+1] = pg[j];
+            line[3*j+2] = pb[j];
+        }
+        break;
+    }
+    default:
+        load_line((const pixel *)img->data + base, line, dim);
+        return;
+    }
+    memset(line + 3 * dim, 0, LINE_PAD * sizeof(float));
+}
+
+/*
+ * line_row_float_avx2 - line_row_avx2() without the truncation: flat
+ *     elements [x0, x1) of one row as float quotients
+ */
+__attribute__((target("avx2")))
+static void line_row_float_avx2(const float *const *rows, const float (*taps)[5],
+                                float *out, int x0, int x1, float weight)
+{
+    int ii, jj, x = x0;
+    const __m256 w = _mm256_set1_ps(weight);
+
+    for (; x + 8 <= x1; x += 8) {
+        __m256 a = _mm256_setzero_ps();
+        for (ii = 0; ii < 5; ii++) {
+            const float *p = rows[ii] + x - 6;
+            for (jj = 0; jj < 5; jj++, p += 3)
+                a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(p),
+                                                   _mm256_broadcast_ss(&taps[ii][jj])));
+        }
+        _mm256_storeu_ps(out + x, _mm256_div_ps(a, w));
+    }
+    for (; x < x1; x++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += rows[ii][x + 3*(jj-2)] * taps[ii][jj];
+        out[x] = sum/weight;
+    }
+}
+
+/*
+ * line_row_float - Flat elements [x0, x1) of row i as float
+ *     quotients, each over its own border class weight
+ */
+static void line_row_float(const float *const *rows, const kernel_plan *kp, float *out,
+                           int x0, int x1, int dim, int i)
+{
+    int ii, jj, x;
+    border_norm scratch;
+
+    for (x = x0; x < x1; x++) {
+        float sum = 0.0f;
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                sum += rows[ii][x + 3*(jj-2)] * kp->taps[ii][jj];
+        out[x] = sum / lookup_norm(kp, dim, i, x / 3, &scratch)->weight;
+    }
+}
+
+typedef struct {
+    const kernel_plan *kp;
+    format_image *dst;
+    pixel *row;          /* one 16-bit result row for the integer formats */
+    float *frow;         /* one float result row for FMT_FLOAT_PLANES */
+} format_job;
+
+/*
+ * format_row - Row i into dst's format. The integer formats get the
+ *     row from line_emit_row() into a one-row scratch and narrow it
+ *     from there.
+ */
+static void format_row(int dim, int i, const float *const *rows, void *arg)
+{
+    format_job *f = arg;
+    long base = (long)i * dim;
+    int j, x;
+
+    if (f->dst->format == FMT_FLOAT_PLANES) {
+        float *pr = FORMAT_PLANE(f->dst, 0) + base;
+        float *pg = FORMAT_PLANE(f->dst, 1) + base;
+        float *pb = FORMAT_PLANE(f->dst, 2) + base;
+        int lo = dim >= 5 ? 6 : 3 * dim;
+        int hi = dim >= 5 ? 3 * dim - 6 : 3 * dim;
+
+        line_row_float(rows, f->kp, f->frow, 0, lo, dim, i);
+        if (hi > lo && __builtin_cpu_supports("avx2"))
+            line_row_float_avx2(rows, (const float (*)[5])f->kp->taps, f->frow, lo, hi,
+                                f->kp->norm[edge_class(i, dim)][2].weight);
+        else
+            line_row_float(rows, f->kp, f->frow, lo, hi, dim, i);
+        line_row_float(rows, f->kp, f->frow, hi > lo ? hi : lo, 3 * dim, dim, i);
+        for (j = 0; j < dim; j++) {
+            pr[j] = f->frow[3*j];
+            pg[j] = f->frow[3*j+1];
+            pb[j] = f->frow[3*j+2];
+        }
+        return;
+    }
+
+    {
+        const unsigned short *s = (const unsigned short *)f->row;
+
+        line_emit_row(rows, f->kp, f->row, dim, dim, i);
+        if (f->dst->format == FMT_RGB24) {
+            unsigned char *d = (unsigned char *)f->dst->data + 3 * base;
+            for (x = 0; x < 3 * dim; x++)
+                d[x] = (unsigned char)s[x];
+        } else if (f->dst->format == FMT_RGBX64) {
+            pixel64 *d = (pixel64 *)f->dst->data + base;
+            for (j = 0; j < dim; j++) {
+                d[j].red = f->row[j].red;
+                d[j].green = f->row[j].green;
+                d[j].blue = f->row[j].blue;
+                d[j].pad = 0;
+            }
+        } else {
+            memcpy((pixel *)f->dst->data + base, f->row, dim * sizeof(pixel));
+        }
+    }
+}
+
+/*
+ * format_convolve - dst = convolve() of src, both in src's format.
+ *     Returns -1 if memory runs out.
+ */
+int format_convolve(const format_image *src, format_image *dst)
+{
+    format_job f = {get_kernel_plan(), dst, NULL, NULL};
+    int dim = src->dim, ok = 0;
+
+    if (src->format == FMT_RGB48) {
+        pixel *d = dst->data;
+        line_batch b = {&f.kp, &d, 1, dim, dim};
+        return line_stream(dim, src->data, line_batch_row, &b) ? 0 : -1;
+    }
+    f.row = malloc(dim * sizeof(pixel));
+    f.frow = malloc(3 * (size_t)dim * sizeof(float));
+    if (f.row && f.frow)
+        ok = line_stream_from(dim, dim, line_load_format, (void *)src, format_row, &f);
+    free(f.row);
+    free(f.frow);
+    return ok ? 0 : -1;
+}
+
+/***************************************************************
+ * Halo-padded images. A halo_image keeps HALO pixels of border
+ * around the frame, filled by a boundary mode, so a 5x5 window
+ * never leaves the allocation and convolve runs one loop over the
+ * whole image with no bounds checks. HALO_ZERO reproduces
+ * check_convolution(): the zeros add nothing to a sum, and the
+ * weight that would have been skipped is handled by dividing by a
+ * per-column weight row, rebuilt only when the row's border class
+ * changes. The other modes divide by the full tap sum.
+ **************************************************************/
+
+/*
+ * halo_source - The image coordinate whose value halo coordinate x
+ *     (in [-HALO, dim+HALO)) shows, or -1 for a zero
+ */
+static int halo_source(halo_mode mode, int x, int dim)
+{
+    if (x >= 0 && x < dim)
+        return x;
+    switch (mode) {
+    case HALO_CLAMP:
+        return x < 0 ? 0 : dim - 1;
+    case HALO_MIRROR:
+        x = x < 0 ? -x : 2 * (dim - 1) - x;
+        return x < 0 ? 0 : x >= dim ? dim - 1 : x;
+    case HALO_WRAP:
+        return ((x % dim) + dim) % dim;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * halo_alloc - Allocates a dim x dim image with a HALO border in
+ *     mode. Rows are padded to a multiple of 16 bytes beyond the
+ *     halo. The zero halo is written here, once. Returns 0 if memory
+ *     runs out.
+ */
+int halo_alloc(halo_image *img, int dim, halo_mode mode)
+{
+    size_t bytes;
+
+    img->dim = dim;
+    img->mode = mode;
+    img->stride = (dim + 2 * HALO + 7) & ~7;
+    bytes = (size_t)(dim + 2 * HALO) * img->stride * sizeof(pixel);
+    img->base = aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+    if (!img->base)
+        return 0;
+    memset(img->base, 0, bytes);
+    img->pixels = img->base + RIDX(HALO, HALO, img->stride);
+    return 1;
+}
+
+void halo_free(halo_image *img)
+{
+    free(img->base);
+    img->base = img->pixels = NULL;
+}
+
+/*
+ * halo_update - Refreshes the halo after rows [r0, r1) changed. Only
+ *     the halo cells that show those rows are written: their side
+ *     cells, then any top or bottom halo row copied from them (side
+ *     cells included, which takes care of the corners). The cost is
+ *     O(r1 - r0 + dim), never O(dim^2); the zero halo never changes.
+ */
+void halo_update(halo_image *img, int r0, int r1)
+{
+    int dim = img->dim, stride = img->stride;
+    int i, h, src;
+
+    if (img->mode == HALO_ZERO)
+        return;
+    for (i = r0; i < r1; i++) {
+        pixel *row = &img->pixels[RIDX(i, 0, stride)];
+        for (h = 1; h <= HALO; h++) {
+            row[-h] = row[halo_source(img->mode, -h, dim)];
+            row[dim - 1 + h] = row[halo_source(img->mode, dim - 1 + h, dim)];
+        }
+    }
+    for (h = 1; h <= HALO; h++) {
+        src = halo_source(img->mode, -h, dim);
+        if (src >= r0 && src < r1)
+            memcpy(&img->pixels[RIDX(-h, -HALO, stride)], &img->pixels[RIDX(src, -HALO, stride)],
+                   (dim + 2 * HALO) * sizeof(pixel));
+        src = halo_source(img->mode, dim - 1 + h, dim);
+        if (src >= r0 && src < r1)
+            memcpy(&img->pixels[RIDX(dim - 1 + h, -HALO, stride)],
+                   &img->pixels[RIDX(src, -HALO, stride)], (dim + 2 * HALO) * sizeof(pixel));
+    }
+}
+
+/*
+ * halo_fill - Fills the whole halo for the current mode (after a
+ *     mode change, say): O(perimeter)
+ */
+void halo_fill(halo_image *img)
+{
+    int dim = img->dim, stride = img->stride;
+    int i, h;
+
+    if (img->mode != HALO_ZERO) {
+        halo_update(img, 0, dim);
+        return;
+    }
+    for (h = 1; h <= HALO; h++) {
+        memset(&img->pixels[RIDX(-h, -HALO, stride)], 0, (dim + 2 * HALO) * sizeof(pixel));
+        memset(&img->pixels[RIDX(dim - 1 + h, -HALO, stride)], 0,
+               (dim + 2 * HALO) * sizeof(pixel));
+    }
+    for (i = 0; i < dim; i++) {
+        memset(&img->pixels[RIDX(i, -HALO, stride)], 0, HALO * sizeof(pixel));
+        memset(&img->pixels[RIDX(i, dim, stride)], 0, HALO * sizeof(pixel));
+    }
+}
+
+/*
+ * halo_load_rows - Copies rows [r0, r1) of the dim x dim image src in
+ *     and refreshes the halo cells that show them
+ */
+void halo_load_rows(halo_image *img, const pixel *src, int r0, int r1)
+{
+    int i;
+
+    for (i = r0; i < r1; i++)
+        memcpy(&img->pixels[RIDX(i, 0, img->stride)], &src[RIDX(i, 0, img->dim)],
+               img->dim * sizeof(pixel));
+    halo_update(img, r0, r1);
+}
+
+/*
+ * halo_weights - Per flat element divisors for row i: the in-bounds
+ *     tap sum of each pixel's border class for HALO_ZERO, the full
+ *     tap sum otherwise
+ */
+static void halo_weights(const kernel_plan *kp, const halo_image *img, int i, float *w)
+{
+    border_norm scratch;
+    float full = 0.0f;
+    int ii, jj, j;
+
+    if (img->mode != HALO_ZERO) {
+        for (ii = 0; ii < 5; ii++)
+            for (jj = 0; jj < 5; jj++)
+                full += kp->taps[ii][jj];
+    }
+    for (j = 0; j < img->dim; j++) {
+        float wt = img->mode == HALO_ZERO ?
+            lookup_norm(kp, img->dim, i, j, &scratch)->weight : full;
+        w[3*j] = w[3*j+1] = w[3*j+2] = wt;
+    }
+}
+
+/*
+ * halo_row_avx2 - Flat elements [0, n) of one output row; s points at
+ *     the row two above, at the first pixel (its halo is at s[-6..-1])
+ */
+__attribute__((target("avx2")))
+static int halo_row_avx2(const unsigned short *s, int stride, const float (*taps)[5],
+                         const float *w, unsigned short *out, int n)
+{
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    int ii, jj, x;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+        for (ii = 0; ii < 5; ii++) {
+            const unsigned short *p = s + ii*stride + x - 6;
+            for (jj = 0; jj < 5; jj++, p += 3) {
+                __m256 k = _mm256_broadcast_ss(&taps[ii][jj]);
+                a0 = _mm256_add_ps(a0, _mm256_mul_ps(LOAD8_PS(p), k));
+                a1 = _mm256_add_ps(a1, _mm256_mul_ps(LOAD8_PS(p + 8), k));
+            }
+        }
+        __m256i q = _mm256_packus_epi32(
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a0, _mm256_loadu_ps(w + x))), low16),
+            _mm256_and_si256(_mm256_cvttps_epi32(_mm256_div_ps(a1, _mm256_loadu_ps(w + x + 8))), low16));
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_permute4x64_epi64(q, 0xD8));
+    }
+    return x;
+}
+
+/*
+ * halo_convolve - dst (dim x dim) = convolve() of img with img's
+ *     boundary mode. One loop covers every pixel: no bounds checks
+ *     and no border cases. Returns -1 if memory runs out.
+ */
+int halo_convolve(const halo_image *img, pixel *dst)
+{
+    const kernel_plan *kp = get_kernel_plan();
+    int dim = img->dim, stride = 3 * img->stride;
+    int avx2 = __builtin_cpu_supports("avx2");
+    int i, ii, jj, x, cls = -1;
+    float *w = malloc(3 * (size_t)dim * sizeof(float));
+
+    if (!w)
+        return -1;
+    for (i = 0; i < dim; i++) {
+        const unsigned short *s = (const unsigned short *)&img->pixels[RIDX(i - 2, 0, img->stride)];
+        unsigned short *out = (unsigned short *)&dst[RIDX(i, 0, dim)];
+
+        if (dim < 5 || edge_class(i, dim) != cls) {
+            cls = edge_class(i, dim);
+            halo_weights(kp, img, i, w);
+        }
+        x = avx2 ? halo_row_avx2(s, stride, (const float (*)[5])kp->taps, w, out, 3 * dim) : 0;
+        for (; x < 3 * dim; x++) {
+            float sum = 0.0f;
+            for (ii = 0; ii < 5; ii++)
+                for (jj = 0; jj < 5; jj++)
+                    sum += s[ii*stride + x + 3*(jj-2)] * kp->taps[ii][jj];
+            out[x] = (unsigned short)(sum / w[x]);
+        }
+    }
+    free(w);
+    return 0;
+}
+
+static halo_image halo_scratch;
+
+/*
+ * halo_convolve_pixels - convolve() through a zero halo image. The
+ *     driver's src has no halo, so it is copied in first; the halo
+ *     itself is written once, when the scratch image is allocated.
+ */
+char halo_convolve_descr[] = "halo_convolve: Zero halo, one branch-free loop";
+void halo_convolve_pixels(int dim, pixel *src, pixel *dst)
+{
+    if (halo_scratch.dim != dim || !halo_scratch.base) {
+        halo_free(&halo_scratch);
+        if (!halo_alloc(&halo_scratch, dim, HALO_ZERO)) {
+            line_convolve(dim, src, dst);
+            return;
+        }
+    }
+    halo_load_rows(&halo_scratch, src, 0, dim);
+    if (halo_convolve(&halo_scratch, dst))
+        line_convolve(dim, src, dst);
+}
+
+/***************************************************************
+ * Streaming convolve. line_stream_from() only ever holds the ring
+ * of 5 float lines, so an image of any height can be convolved
+ * while its rows are still arriving: each output row goes out as
+ * soon as the row 2 below it has been read. Nothing here is sized
+ * by the height, and rows are addressed with size_t offsets so
+ * images past 2^31 pixels work.
+ **************************************************************/
+
+typedef struct {
+    row_source_func source;
+    void *source_ctx;
+    row_sink_func sink;
+    void *sink_ctx;
+    pixel *in;           /* one source row */
+    pixel *out;          /* one result row */
+    const kernel_plan *kp;
+    int height;
+    int failed;          /* the first nonzero callback return */
+} row_stream;
+
+/* Once a callback fails the remaining rows are skipped */
+static void line_load_source(int width, int r, float *line, void *src)
+{
+    row_stream *s = src;
+
+    if (!s->failed)
+        s->failed = s->source(s->source_ctx, r, s->in);
+    if (s->failed)
+        memset(s->in, 0, width * sizeof(pixel));
+    load_line(s->in, line, width);
+}
+
+static void stream_row(int width, int i, const float *const *rows, void *arg)
+{
+    row_stream *s = arg;
+
+    if (s->failed)
+        return;
+    line_emit_row(rows, s->kp, s->out, width, s->height, i);
+    s->failed = s->sink(s->sink_ctx, i, s->out);
+}
+
+/*
+ * convolve_stream - convolve() of a width x height image whose rows
+ *     are pulled from source and pushed to sink, both in order. Only
+ *     the ring and one row each way are resident. Returns 0, the
+ *     nonzero value a callback stopped the stream with, or
+ *     STREAM_ERROR if memory runs out.
+ */
+int convolve_stream(int width, int height, row_source_func source, void *source_ctx,
+                    row_sink_func sink, void *sink_ctx)
+{
+    row_stream s = {source, source_ctx, sink, sink_ctx};
+    int ok;
+
+    s.kp = get_kernel_plan();
+    s.in = malloc(width * sizeof(pixel));
+    s.out = malloc(width * sizeof(pixel));
+    s.height = height;
+    ok = s.in && s.out && line_stream_from(width, height, line_load_source, &s, stream_row, &s);
+    free(s.in);
+    free(s.out);
+    if (!ok)
+        return STREAM_ERROR;
+    return s.failed;
+}
+
+/*
+ * fd_row - Moves one whole row through fd, riding out short reads and
+ *     writes and signals. Returns STREAM_EOF if the input ends first,
+ *     STREAM_ERROR (with errno set) if a read or write fails.
+ */
+static int fd_row(int fd, void *buf, size_t n, int writing)
+{
+    char *p = buf;
+
+    while (n > 0) {
+        ssize_t got = writing ? write(fd, p, n) : read(fd, p, n);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return STREAM_ERROR;
+        if (got == 0)
+            return writing ? STREAM_ERROR : STREAM_EOF;
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static int fd_source(void *ctx, int r, pixel *row)
+{
+    const int *fd = ctx;
+
+    return fd_row(fd[0], row, fd[1] * sizeof(pixel), 0);
+}
+
+static int fd_sink(void *ctx, int i, const pixel *row)
+{
+    const int *fd = ctx;
+
+    return fd_row(fd[0], (void *)row, fd[1] * sizeof(pixel), 1);
+}
+
+/*
+ * convolve_stream_fd - convolve_stream() from raw rows read off in_fd
+ *     to raw rows written to out_fd, so pipes and sockets work too.
+ *     Returns STREAM_EOF if in_fd ends early.
+ */
+int convolve_stream_fd(int width, int height, int in_fd, int out_fd)
+{
+    int in[2] = {in_fd, width};
+    int out[2] = {out_fd, width};
+
+    return convolve_stream(width, height, fd_source, in, fd_sink, out);
+}
+
+/* Mapped pages are given back in steps of this many bytes */
+#define STREAM_DROP (2 * 1024 * 1024)
+
+typedef struct {
+    const pixel *src;
+    pixel *dst;
+    size_t in_dropped;   /* bytes of each map already given back */
+    size_t out_dropped;
+    const kernel_plan *kp;
+    int height;
+} mmap_stream;
+
+/*
+ * stream_drop - Gives back the pages of map below done, a STREAM_DROP
+ *     step at a time. The input is clean and the output is a shared
+ *     file mapping, so nothing is lost: written pages stay in the
+ *     page cache for writeback, they just leave this process.
+ */
+static void stream_drop(const void *map, size_t *dropped, size_t done)
+{
+    size_t end = done / STREAM_DROP * STREAM_DROP;
+
+    if (end > *dropped) {
+        madvise((char *)map + *dropped, end - *dropped, MADV_DONTNEED);
+        *dropped = end;
+    }
+}
+
+static void line_load_mapped(int width, int r, float *line, void *src)
+{
+    mmap_stream *m = src;
+    size_t row = (size_t)width * sizeof(pixel);
+
+    load_line(m->src + (size_t)r * width, line, width);
+    stream_drop(m->src, &m->in_dropped, (r + 1) * row);
+}
+
+static void mapped_row(int width, int i, const float *const *rows, void *arg)
+{
+    mmap_stream *m = arg;
+    size_t row = (size_t)width * sizeof(pixel);
+
+    line_emit_row(rows, m->kp, m->dst + (size_t)i * width, width, m->height, i);
+    stream_drop(m->dst, &m->out_dropped, (i + 1) * row);
+}
+
+/*
+ * convolve_stream_mmap - convolve_stream() between two image files
+ *     of raw rows, both mapped for sequential access. in_fd must be
+ *     a regular file holding the whole image; out_fd must be open for
+ *     reading and writing and is sized to fit. Pages behind the cursor
+ *     are dropped as it goes. Returns STREAM_EOF if in_fd is too short
+ *     for the image, STREAM_ERROR on any other failure, a pipe for
+ *     in_fd included.
+ */
+int convolve_stream_mmap(int width, int height, int in_fd, int out_fd)
+{
+    size_t bytes = (size_t)width * height * sizeof(pixel);
+    mmap_stream m = {0};
+    struct stat st;
+    void *in, *out;
+    int ok;
+
+    if (bytes == 0 || fstat(in_fd, &st))
+        return STREAM_ERROR;
+    if (!S_ISREG(st.st_mode)) {
+        errno = ENODEV;     /* what mmap() would say */
+        return STREAM_ERROR;
+    }
+    if ((size_t)st.st_size < bytes)
+        return STREAM_EOF;
+    if (ftruncate(out_fd, bytes))
+        return STREAM_ERROR;
+    in = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (in == MAP_FAILED)
+        return STREAM_ERROR;
+    out = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (out == MAP_FAILED) {
+        munmap(in, bytes);
+        return STREAM_ERROR;
+    }
+    madvise(in, bytes, MADV_SEQUENTIAL);
+    madvise(out, bytes, MADV_SEQUENTIAL);
+
+    m.src = in;
+    m.dst = out;
+    m.kp = get_kernel_plan();
+    m.height = height;
+    ok = line_stream_from(width, height, line_load_mapped, &m, mapped_row, &m);
+
+    munmap(in, bytes);
+    munmap(out, bytes);
+    return ok ? 0 : STREAM_ERROR;
+}
+
+typedef struct {
+    const pixel *src;
+    pixel *dst;
+    int dim;
+} memory_rows;
+
+static int memory_source(void *ctx, int r, pixel *row)
+{
+    const memory_rows *m = ctx;
+
+    memcpy(row, &m->src[RIDX(r, 0, m->dim)], m->dim * sizeof(pixel));
+    return 0;
+}
+
+static int memory_sink(void *ctx, int i, const pixel *row)
+{
+    memory_rows *m = ctx;
+
+    memcpy(&m->dst[RIDX(i, 0, m->dim)], row, m->dim * sizeof(pixel));
+    return 0;
+}
+
+/*
+ * stream_convolve - convolve() through convolve_stream(), with the
+ *     rows coming from and going back to memory
+ */
+char stream_convolve_descr[] = "stream_convolve: Row callbacks, O(width) memory";
+void stream_convolve(int dim, pixel *src, pixel *dst)
+{
+    memory_rows m = {src, dst, dim};
+
+    if (convolve_stream(dim, dim, memory_source, &m, memory_sink, &m))
+        line_convolve(dim, src, dst);
+}
+
+/***************************************************************
+ * Arbitrary-size kernels. An nkernel is an odd size x size kernel
+ * applied with check_convolution()'s rule: taps that fall off the
+ * image are dropped and the pixel is divided by the sum of the
+ * taps that remain. That sum comes from a 2D prefix sum of the
+ * taps, so it costs O(1) per pixel at any size.
+ *
+ * Small kernels are applied directly. Large ones go through an
+ * in-tree radix-2 FFT with overlap-add: src is cut into tiles that
+ * leave room for the kernel's spread, each tile is multiplied by
+ * the kernel's spectrum, and the results are summed into a band of
+ * rows that is emitted as soon as no later tile can touch it.
+ * nkernel_convolve() picks the path with the lower estimated cost.
+ *
+ * Tolerance: the direct path is bit-exact with check_convolution()
+ * for integer taps whose |taps| sum times 65535 stays below 2^24.
+ * For other taps only the weight's rounding can differ. The FFT
+ * path runs in double precision. For exact integer taps it rounds
+ * every sum back to the integer it must be, so it agrees exactly
+ * with the direct path. For any other taps each channel is within
+ * 1 of the direct path, as long as the clipped weight is not close
+ * to 0.
+ **************************************************************/
+
+/* Estimated cost of one FFT butterfly, in direct multiply-adds */
+#define NK_BUTTERFLY_COST 4.0
+#define NK_MIN_FFT 16
+#define NK_MAX_FFT 1024
+
+/*
+ * nkernel_alloc - Allocates a size x size kernel of zero taps; size
+ *     must be odd. Returns NULL on failure.
+ */
+nkernel *nkernel_alloc(int size)
+{
+    nkernel *k;
+
+    if (size < 1 || !(size & 1))
+        return NULL;
+    k = malloc(sizeof(*k));
+    if (!k)
+        return NULL;
+    k->size = size;
+    k->taps = calloc((size_t)size * size, sizeof(float));
+    if (!k->taps) {
+        free(k);
+        return NULL;
+    }
+    return k;
+}
+
+void nkernel_free(nkernel *k)
+{
+    if (k) {
+        free(k->taps);
+        free(k);
+    }
+}
+
+/*
+ * nk_prefix - P[(a)*(s+1) + b] = sum of taps in rows < a, cols < b
+ */
+static double *nk_prefix(const nkernel *k)
+{
+    int s = k->size, a, b;
+    double *p = calloc((size_t)(s + 1) * (s + 1), sizeof(double));
+
+    if (!p)
+        return NULL;
+    for (a = 0; a < s; a++)
+        for (b = 0; b < s; b++)
+            p[(a+1)*(s+1) + b+1] = k->taps[a*s + b] + p[a*(s+1) + b+1] +
+                p[(a+1)*(s+1) + b] - p[a*(s+1) + b];
+    return p;
+}
+
+/*
+ * nk_span - Tap indices [*lo, *hi] that land inside the image for
+ *     output coordinate x
+ */
+static inline void nk_span(int x, int dim, int r, int *lo, int *hi)
+{
+    *lo = x < r ? r - x : 0;
+    *hi = x + r >= dim ? r + dim - 1 - x : 2 * r;
+}
+
+/*
+ * nk_weight - Sum of the taps in rows [a0, a1], cols [b0, b1]
+ */
+static inline float nk_weight(const double *p, int s, int a0, int a1, int b0, int b1)
+{
+    return (float)(p[(a1+1)*(s+1) + b1+1] - p[a0*(s+1) + b1+1] -
+                   p[(a1+1)*(s+1) + b0] + p[a0*(s+1) + b0]);
+}
+
+/*
+ * nk_exact - Taps are integers small enough for every sum to be exact
+ */
+static int nk_exact(const nkernel *k)
+{
+    float abs_sum = 0.0f;
+    int t;
+
+    for (t = 0; t < k->size * k->size; t++) {
+        if (!is_integer_tap(k->taps[t]))
+            return 0;
+        abs_sum += k->taps[t] < 0 ? -k->taps[t] : k->taps[t];
+    }
+    return abs_sum * CHANNEL_MAX < FLOAT_EXACT_LIMIT;
+}
+
+/*
+ * nkernel_convolve_direct - Sums the in-image taps of every pixel in
+ *     check_convolution() order
+ */
+void nkernel_convolve_direct(int dim, const nkernel *k, pixel *src, pixel *dst)
+{
+    int s = k->size, r = s / 2;
+    int i, j, a, b, a0, a1, b0, b1;
+    double *p = nk_prefix(k);
+
+    if (!p)
+        return;
+    for (i = 0; i < dim; i++) {
+        nk_span(i, dim, r, &a0, &a1);
+        for (j = 0; j < dim; j++) {
+            float red = 0.0f, green = 0.0f, blue = 0.0f, weight;
+            nk_span(j, dim, r, &b0, &b1);
+            for (a = a0; a <= a1; a++) {
+                const pixel *row = &src[RIDX(i+a-r, j-r, dim)];
+                const float *t = &k->taps[a*s];
+                for (b = b0; b <= b1; b++) {
+                    red   += row[b].red   * t[b];
+                    green += row[b].green * t[b];
+                    blue  += row[b].blue  * t[b];
+                }
+            }
+            weight = nk_weight(p, s, a0, a1, b0, b1);
+            dst[RIDX(i,j,dim)].red   = (unsigned short)(red/weight);
+            dst[RIDX(i,j,dim)].green = (unsigned short)(green/weight);
+            dst[RIDX(i,j,dim)].blue  = (unsigned short)(blue/weight);
+        }
+    }
+    free(p);
+}
+
+typedef struct {
+    double re, im;
+} nk_complex;
+
+/*
+ * nk_fft - In-place radix-2 FFT of n points spaced stride apart;
+ *     tw[k] = exp(-2 pi i k / n). The inverse is left unscaled.
+ */
+static void nk_fft(nk_complex *a, int n, int stride, const nk_complex *tw, int inverse)
+{
+    int i, j, bit, len, k;
+    nk_complex t, u, v, w;
+
+    for (i = 1, j = 0; i < n; i++) {
+        for (bit = n >> 1; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            t = a[i*stride];
+            a[i*stride] = a[j*stride];
+            a[j*stride] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        int half = len / 2, step = n / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < half; k++) {
+                w = tw[k * step];
+                if (inverse)
+                    w.im = -w.im;
+                u = a[(i+k)*stride];
+                t = a[(i+k+half)*stride];
+                v.re = t.re * w.re - t.im * w.im;
+                v.im = t.re * w.im + t.im * w.re;
+                a[(i+k)*stride].re = u.re + v.re;
+                a[(i+k)*stride].im = u.im + v.im;
+                a[(i+k+half)*stride].re = u.re - v.re;
+                a[(i+k+half)*stride].im = u.im - v.im;
+            }
+        }
+    }
+}
+
+/*
+ * nk_fft2 - 2D FFT of an n x n block whose rows >= rows are all zero
+ *     (their row transforms are skipped)
+ */
+static void nk_fft2(nk_complex *a, int n, int rows, const nk_complex *tw, int inverse)
+{
+    int i;
+
+    for (i = 0; i < rows; i++)
+        nk_fft(&a[i*n], n, 1, tw, inverse);
+    for (i = 0; i < n; i++)
+        nk_fft(&a[i], n, n, tw, inverse);
+}
+
+/*
+ * nk_fft_cost - Estimated cost of the FFT path with n x n transforms,
+ *     in direct multiply-adds; 0 if n can't hold the kernel
+ */
+static double nk_fft_cost(int dim, int s, int n)
+{
+    int t = n - s + 1, log2n = 0, tiles;
+
+    if (t < 1)
+        return 0.0;
+    while ((1 << log2n) < n)
+        log2n++;
+    tiles = (dim + t - 1) / t;
+    /* two forward and two inverse 2D transforms, two spectrum products */
+    return (double)tiles * tiles *
+        (4.0 * n * n * log2n * NK_BUTTERFLY_COST + 2.0 * n * n * 4.0);
+}
+
+/*
+ * nk_best_fft - The cheapest transform size for the FFT path, and its
+ *     cost in *cost
+ */
+static int nk_best_fft(int dim, int s, double *cost)
+{
+    int n, best = 0;
+    double c;
+
+    *cost = 0.0;
+    for (n = NK_MIN_FFT; n <= NK_MAX_FFT; n <<= 1) {
+        c = nk_fft_cost(dim, s, n);
+        if (c > 0.0 && (!best || c < *cost)) {
+            best = n;
+            *cost = c;
+        }
+        if (n - s + 1 >= dim)
+            break;
+    }
+    return best;
+}
+
+/*
+ * nk_store - Normalizes one accumulated channel sum
+ */
+static inline unsigned short nk_store(double sum, float weight, int exact)
+{
+    if (exact)
+        sum = sum >= 0.0 ? (double)(long long)(sum + 0.5) : -(double)(long long)(0.5 - sum);
+    return (unsigned short)((float)sum / weight);
+}
+
+/*
+ * nk_fft_convolve - The FFT path with n x n transforms. Red and green
+ *     share one complex transform (real and imaginary parts) and blue
+ *     takes another; the kernel is real, so they don't mix. Returns
+ *     -1 if memory runs out.
+ */
+static int nk_fft_convolve(int dim, const nkernel *k, pixel *src, pixel *dst, int n)
+{
+    int s = k->size, r = s / 2, t = n - s + 1, w = dim + s - 1;
+    int exact = nk_exact(k);
+    int ti, tj, th, tw_, u, v, a, b, c, i, j, a0, a1, b0, b1, done;
+    size_t nn = (size_t)n * n;
+    nk_complex *tw = malloc(n / 2 * sizeof(nk_complex));
+    nk_complex *spec = calloc(nn, sizeof(nk_complex));
+    nk_complex *rg = malloc(nn * sizeof(nk_complex));
+    nk_complex *bl = malloc(nn * sizeof(nk_complex));
+    double *band = calloc(3 * (size_t)n * w, sizeof(double));
+    double *p = nk_prefix(k);
+    int ret = -1;
+
+    if (!tw || !spec || !rg || !bl || !band || !p)
+        goto out;
+
+    for (i = 0; i < n / 2; i++) {
+        tw[i].re = cos(-2.0 * M_PI * i / n);
+        tw[i].im = sin(-2.0 * M_PI * i / n);
+    }
+    /* flipped kernel, so the product correlates like check_convolution();
+       the 1/n^2 of the inverse transforms is folded in here */
+    for (a = 0; a < s; a++)
+        for (b = 0; b < s; b++)
+            spec[a*n + b].re = k->taps[(s-1-a)*s + (s-1-b)] / (double)nn;
+    nk_fft2(spec, n, s, tw, 0);
+
+    /* band row u holds full-convolution row ti + u */
+    for (ti = 0; ti < dim; ti += t) {
+        th = dim - ti < t ? dim - ti : t;
+        for (tj = 0; tj < dim; tj += t) {
+            tw_ = dim - tj < t ? dim - tj : t;
+            memset(rg, 0, nn * sizeof(nk_complex));
+            memset(bl, 0, nn * sizeof(nk_complex));
+            for (u = 0; u < th; u++) {
+                const pixel *row = &src[RIDX(ti+u, tj, dim)];
+                for (v = 0; v < tw_; v++) {
+                    rg[u*n + v].re = row[v].red;
+                    rg[u*n + v].im = row[v].green;
+                    bl[u*n + v].re = row[v].blue;
+                }
+            }
+            nk_fft2(rg, n, th, tw, 0);
+            nk_fft2(bl, n, th, tw, 0);
+            for (c = 0; c < (int)nn; c++) {
+                nk_complex x = rg[c], y = bl[c], kc = spec[c];
+                rg[c].re = x.re * kc.re - x.im * kc.im;
+                rg[c].im = x.re * kc.im + x.im * kc.re;
+                bl[c].re = y.re * kc.re - y.im * kc.im;
+                bl[c].im = y.re * kc.im + y.im * kc.re;
+            }
+            nk_fft2(rg, n, n, tw, 1);
+            nk_fft2(bl, n, n, tw, 1);
+            for (u = 0; u < th + s - 1; u++) {
+                double *br = &band[(0*n + u) * (size_t)w + tj];
+                double *bg = &band[(1*n + u) * (size_t)w + tj];
+                double *bb = &band[(2*n + u) * (size_t)w + tj];
+                for (v = 0; v < tw_ + s - 1; v++) {
+                    br[v] += rg[u*n + v].re;
+                    bg[v] += rg[u*n + v].im;
+                    bb[v] += bl[u*n + v].re;
+                }
+            }
+        }
+
+        /* rows no later tile reaches: output rows ti + u - r */
+        done = ti + th >= dim ? th + s - 1 : th;
+        for (u = 0; u < done; u++) {
+            i = ti + u - r;
+            if (i < 0 || i >= dim)
+                continue;
+            nk_span(i, dim, r, &a0, &a1);
+            for (j = 0; j < dim; j++) {
+                float weight;
+                nk_span(j, dim, r, &b0, &b1);
+                weight = nk_weight(p, s, a0, a1, b0, b1);
+                dst[RIDX(i,j,dim)].red =
+                    nk_store(band[(0*n + u) * (size_t)w + j + r], weight, exact);
+                dst[RIDX(i,j,dim)].green =
+                    nk_store(band[(1*n + u) * (size_t)w + j + r], weight, exact);
+                dst[RIDX(i,j,dim)].blue =
+                    nk_store(band[(2*n + u) * (size_t)w + j + r], weight, exact);
+            }
+        }
+        for (c = 0; c < 3; c++) {
+            double *plane = &band[(size_t)c * n * w];
+            memmove(plane, &plane[(size_t)th * w], (size_t)(n - th) * w * sizeof(double));
+            memset(&plane[(size_t)(n - th) * w], 0, (size_t)th * w * sizeof(double));
+        }
+    }
+    ret = 0;
+
+out:
+    free(tw);
+    free(spec);
+    free(rg);
+    free(bl);
+    free(band);
+    free(p);
+    return ret;
+}
+
+/*
+ * nkernel_convolve_fft - Forces the FFT path (at its cheapest size);
+ *     falls back to the direct path if memory runs out
+ */
+void nkernel_convolve_fft(int dim, const nkernel *k, pixel *src, pixel *dst)
+{
+    double cost;
+    int n = nk_best_fft(dim, k->size, &cost);
+
+    if (!n || nk_fft_convolve(dim, k, src, dst, n) < 0)
+        nkernel_convolve_direct(dim, k, src, dst);
+}
+
+/*
+ * nkernel_convolve - Applies k to src by whichever path the cost
+ *     model says is cheaper
+ */
+void nkernel_convolve(int dim, const nkernel *k, pixel *src, pixel *dst)
+{
+    double direct = 3.0 * dim * dim * k->size * k->size, cost;
+    int n = nk_best_fft(dim, k->size, &cost);
+
+    if (n && cost < direct && nk_fft_convolve(dim, k, src, dst, n) == 0)
+        return;
+    nkernel_convolve_direct(dim, k, src, dst);
+}
+
+/*
+ * active_nkernel - kernel[][] as a 5x5 nkernel
+ */
+static nkernel *active_nkernel(void)
+{
+    static nkernel *k = NULL;
+
+    if (!k && !(k = nkernel_alloc(5)))
+        return NULL;
+    memcpy(k->taps, kernel, 25 * sizeof(float));
+    return k;
+}
+
+/*
+ * nkernel_active_convolve - The active kernel through nkernel_convolve()
+ */
+char nkernel_convolve_descr[] = "nkernel_convolve: Any-size kernel engine, cost-model path";
+void nkernel_active_convolve(int dim, pixel *src, pixel *dst)
+{
+    nkernel *k = active_nkernel();
+
+    if (k)
+        nkernel_convolve(dim, k, src, dst);
+    else
+        convolve(dim, src, dst);
+}
+
+/*
+ * fft_convolve - The active kernel through the FFT path
+ */
+char fft_convolve_descr[] = "fft_convolve: Overlap-add FFT with the active kernel";
+void fft_convolve(int dim, pixel *src, pixel *dst)
+{
+    nkernel *k = active_nkernel();
+
+    if (k)
+        nkernel_convolve_fft(dim, k, src, dst);
+    else
+        convolve(dim, src, dst);
+}
+
+/***************************************************************
+ * Worker pool. Threads are started on first use and kept for the
+ * life of the process. A job is a function over a range of rows,
+ * cut into bands of BAND_ROWS. Each worker starts with its own
+ * contiguous run of bands and, once that is empty, steals the back
+ * half of the next non-empty queue it finds, so a slow band
+ * near the end doesn't leave the other cores idle.
+ *
+ * The pool size comes from PERFLAB_THREADS, defaulting to the
+ * number of online cores.
+ **************************************************************/
+
+#define MAX_WORKERS 64
+#define BAND_ROWS 8
+
+typedef void (*band_func)(int, int, void *);   /* first row, end row, job args */
+
+/* One worker's bands: next in the low 32 bits, end in the high 32 */
+typedef struct {
+    unsigned long long range;
+    char pad[64 - sizeof(unsigned long long)];  /* keep queues on separate lines */
+} band_queue;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int nthreads;
+    unsigned long generation;   /* bumped for every job */
+    int busy;                   /* helper threads still running the job */
+    band_func fn;
+    void *arg;
+    int rows;
+    band_queue queue[MAX_WORKERS];
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+#define RANGE(next, end) (((unsigned long long)(end) << 32) | (unsigned int)(next))
+#define RANGE_NEXT(r) ((unsigned int)(r))
+#define RANGE_END(r) ((unsigned int)((r) >> 32))
+
+/*
+ * take_band - Pops the front band of queue q, returns -1 if it's empty
+ */
+static int take_band(band_queue *q)
+{
+    unsigned long long r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+
+    while (RANGE_NEXT(r) < RANGE_END(r)) {
+        if (__atomic_compare_exchange_n(&q->range, &r, RANGE(RANGE_NEXT(r) + 1, RANGE_END(r)),
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return RANGE_NEXT(r);
+    }
+    return -1;
+}
+
+/*
+ * steal_bands - Moves the back half of some other worker's bands into
+ *     worker self's (empty) queue. Returns 0 when nobody has any left.
+ */
+static int steal_bands(int self)
+{
+    int v;
+
+    for (v = 1; v < pool.nthreads; v++) {
+        band_queue *q = &pool.queue[(self + v) % pool.nthreads];
+        unsigned long long r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+
+        while (RANGE_NEXT(r) < RANGE_END(r)) {
+            unsigned int next = RANGE_NEXT(r), end = RANGE_END(r);
+            unsigned int mid = end - (end - next + 1) / 2;
+            if (__atomic_compare_exchange_n(&q->range, &r, RANGE(next, mid),
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&pool.queue[self].range, RANGE(mid, end), __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * run_bands - Runs bands from worker self's queue, then steals, until
+ *     every band of the current job has been claimed
+ */
+static void run_bands(int self)
+{
+    int band;
+
+    do {
+        while ((band = take_band(&pool.queue[self])) >= 0) {
+            int first = band * BAND_ROWS;
+            int end = first + BAND_ROWS < pool.rows ? first + BAND_ROWS : pool.rows;
+            pool.fn(first, end, pool.arg);
+        }
+    } while (steal_bands(self));
+}
+
+static void *pool_worker(void *vargp)
+{
+    int self = (int)(long)vargp;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_bands(self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0)
+            pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/*
+ * pool_init - Sizes the pool from PERFLAB_THREADS (or the core count)
+ *     and starts all but one worker; the calling thread is worker 0
+ */
+static void pool_init(void)
+{
+    char *env = getenv("PERFLAB_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t tid;
+
+    if (n < 1)
+        n = 1;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+    for (pool.nthreads = 1; pool.nthreads < n; pool.nthreads++) {
+        if (pthread_create(&tid, NULL, pool_worker, (void *)(long)pool.nthreads) != 0)
+            break;
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * pool_run - Runs fn over rows [0, rows) on every worker and returns
+ *     when all bands are done. With one thread it is a plain call.
+ */
+static void pool_run(band_func fn, void *arg, int rows)
+{
+    int w, nbands, per;
+
+    pthread_once(&pool_once, pool_init);
+    if (pool.nthreads == 1) {
+        fn(0, rows, arg);
+        return;
+    }
+
+    nbands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+    per = (nbands + pool.nthreads - 1) / pool.nthreads;
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.rows = rows;
+    for (w = 0; w < pool.nthreads; w++) {
+        int first = w * per < nbands ? w * per : nbands;
+        int end = first + per < nbands ? first + per : nbands;
+        pool.queue[w].range = RANGE(first, end);
+    }
+    pool.busy = pool.nthreads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_bands(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Arguments of one threaded_convolve() job */
+typedef struct {
+    int dim;
+    const pixel *src;
+    pixel *dst;
+    const kernel_plan *kp;
+    int use_int;
+} convolve_job;
+
+static void convolve_job_band(int i0, int i1, void *arg)
+{
+    convolve_job *job = arg;
+
+    if (job->use_int)
+        int_convolve_rows(job->dim, job->src, job->dst, job->kp, NULL, i0, i1);
+    else
+        simd_convolve_rows(job->dim, job->src, job->dst, job->kp, i0, i1);
+}
+
+/*
+ * threaded_convolve - Row bands of the integer (or float) engine spread
+ *     over the worker pool. Each output pixel is computed the same way
+ *     whatever band it falls in, so any thread count gives the same
+ *     image as the serial engines.
+ */
+char threaded_convolve_descr[] = "threaded_convolve: Row bands on a work-stealing pool";
+void threaded_convolve(int dim, pixel *src, pixel *dst)
+{
+    convolve_job job;
+
+    /* plan lookups aren't thread safe, so settle them here before
+       any worker runs */
+    job.kp = get_kernel_plan();
+    job.use_int = int_convolve_usable(job.kp);
+    job.dim = dim;
+    job.src = src;
+    job.dst = dst;
+    pool_run(convolve_job_band, &job, dim);
+}
+
+/*********************************************************************
  * register_convolve_functions - Register all of your different versions
  *     of the convolve kernel with the driver by calling the
  *     add_convolve_function() for each test function.  When you run the
@@ -191,6 +5115,20 @@ void convolve(int dim, pixel *src, pixel *dst)
 
 void register_convolve_functions() {
     add_convolve_function(&convolve, convolve_descr);
+    add_convolve_function(&separable_convolve, separable_convolve_descr);
+    add_convolve_function(&simd_convolve, simd_convolve_descr);
+    add_convolve_function(&int_convolve, int_convolve_descr);
+    add_convolve_function(&threaded_convolve, threaded_convolve_descr);
+    add_convolve_function(&spec_convolve, spec_convolve_descr);
+    add_convolve_function(&jit_convolve, jit_convolve_descr);
+    add_convolve_function(&strip_convolve, strip_convolve_descr);
+    add_convolve_function(&nkernel_active_convolve, nkernel_convolve_descr);
+    add_convolve_function(&fft_convolve, fft_convolve_descr);
+    add_convolve_function(&line_convolve, line_convolve_descr);
+    add_convolve_function(&planar_convolve_pixels, planar_convolve_descr);
+    add_rect_convolve_function(&convolve_rect, convolve_rect_descr);
+    add_convolve_function(&halo_convolve_pixels, halo_convolve_descr);
+    add_convolve_function(&stream_convolve, stream_convolve_descr);
     //add_convolve_function(&naive_convolve, naive_convolve_descr);
     /* ... Register additional test functions here */
 }
@@ -0,0 +1,179 @@
+/*
+ * kernels.h - What kernels.c offers beyond flip() and convolve().
+ * defs.h is left as the lab hands it out; additions to the interface
+ * between kernels.c and the driver go here.
+ */
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+ 
+#include "defs.h"
+ 
+typedef void (*lab_inplace_func) (int, pixel*);
+/* width, height, src, src_stride, dst, dst_stride */
+typedef void (*lab_rect_func) (int, int, pixel*, int, pixel*, int);
+ 
+/* A planar image: each channel in its own 64-byte aligned plane */
+typedef struct {
+   int dim;
+   unsigned short *red;
+   unsigned short *green;
+   unsigned short *blue;
+} planar_image;
+ 
+/* 8-bit RGB and 16-bit RGB padded to 8 bytes */
+typedef struct {
+   unsigned char red;
+   unsigned char green;
+   unsigned char blue;
+} pixel24;
+ 
+typedef struct {
+   unsigned short red;
+   unsigned short green;
+   unsigned short blue;
+   unsigned short pad;
+} pixel64;
+ 
+/* How a format_image stores its pixels */
+typedef enum {
+   FMT_RGB48,          /* pixel */
+   FMT_RGB24,          /* pixel24 */
+   FMT_RGBX64,         /* pixel64 */
+   FMT_FLOAT_PLANES,   /* red, green and blue float planes, back to back */
+   FMT_COUNT
+} pixel_format;
+ 
+/* A dim x dim image in any pixel_format */
+typedef struct {
+   pixel_format format;
+   int dim;
+   void *data;
+} format_image;
+ 
+/* What the border of a halo_image shows beyond the frame */
+typedef enum {
+   HALO_ZERO,          /* zeros, normalized like check_convolution() */
+   HALO_CLAMP,         /* the nearest edge pixel */
+   HALO_MIRROR,        /* reflected about the edge pixel */
+   HALO_WRAP           /* the opposite edge */
+} halo_mode;
+ 
+#define HALO 2
+ 
+/* A dim x dim image inside a HALO-pixel border: rows are stride
+   pixels apart and pixels points at (0, 0) */
+typedef struct {
+   int dim;
+   int stride;
+   halo_mode mode;
+   pixel *pixels;
+   pixel *base;        /* the allocation, halo included */
+} halo_image;
+ 
+/* Row callbacks for convolve_stream(): rows come and go in order,
+   width pixels each; a nonzero return stops the stream */
+typedef int (*row_source_func)(void *, int, pixel *);
+typedef int (*row_sink_func)(void *, int, const pixel *);
+ 
+/* What the convolve_stream functions return besides 0 */
+#define STREAM_ERROR (-1)   /* out of memory, or I/O failed (see errno) */
+#define STREAM_EOF   (-2)   /* the input ended before the last row */
+ 
+/* An odd size x size kernel, taps in row-major order */
+typedef struct {
+   int size;
+   float *taps;
+} nkernel;
+ 
+/* The seven RIDX_F mappings plus the identity: the dihedral group D4.
+   Each value is a set of FLIP_* bits, applied in the order swap
+   (transpose), then reverse dst rows, then reverse dst columns. */
+#define FLIP_COLS_REV 1
+#define FLIP_ROWS_REV 2
+#define FLIP_SWAP     4
+typedef enum {
+   FLIP_IDENTITY          = 0,
+   FLIP_MIRROR_VERTICAL   = FLIP_COLS_REV,
+   FLIP_MIRROR_HORIZONTAL = FLIP_ROWS_REV,
+   FLIP_MIRROR_BOTH       = FLIP_ROWS_REV | FLIP_COLS_REV,
+   FLIP_TRANSPOSE         = FLIP_SWAP,
+   FLIP_ROTATE_CW         = FLIP_SWAP | FLIP_COLS_REV,
+   FLIP_ROTATE_ACW        = FLIP_SWAP | FLIP_ROWS_REV,
+   FLIP_REFLECT_BOTH      = FLIP_SWAP | FLIP_ROWS_REV | FLIP_COLS_REV
+} flip_transform;
+ 
+/* A flipped image that has not been written out: pixel (i, j) of
+   the view is src[o + i*di + j*dj] */
+typedef struct {
+   pixel *src;
+   int dim;
+   flip_transform t;
+   long o, di, dj;
+   pixel *copy;      /* the view materialized, or NULL */
+} flip_view;
+ 
+#define FLIP_VIEW_AT(v, i, j) ((v)->src[(v)->o + (long)(i)*(v)->di + (long)(j)*(v)->dj])
+ 
+int planar_alloc(planar_image *, int);
+void planar_free(planar_image *);
+void pixels_to_planar(int, const pixel *, planar_image *);
+void planar_to_pixels(int, const planar_image *, pixel *);
+void planar_flip(const planar_image *, planar_image *);
+void planar_convolve(const planar_image *, planar_image *);
+ 
+nkernel *nkernel_alloc(int);
+void nkernel_free(nkernel *);
+void nkernel_convolve(int, const nkernel *, pixel *, pixel *);
+void nkernel_convolve_direct(int, const nkernel *, pixel *, pixel *);
+void nkernel_convolve_fft(int, const nkernel *, pixel *, pixel *);
+ 
+void add_inplace_flip_function(lab_inplace_func, char*);
+void add_rect_flip_function(lab_rect_func, char*);
+void add_rect_convolve_function(lab_rect_func, char*);
+ 
+int int_convolve_verify(void);
+void spec_convolve(int, pixel *, pixel *);
+int spec_convolve_kernel(void);
+lab_test_func jit_compile_convolve(Kernel *);
+void jit_release(lab_test_func);
+int convolve_batch(int, Kernel *const *, int, pixel *, pixel *const *);
+int convolve_gradient(int, Kernel *, Kernel *, pixel *, pixel *);
+void flip_convolve(int, pixel *, pixel *);
+ 
+int current_flip_transform(void);
+void flip_view_init(flip_view *, flip_transform, int, pixel *);
+void flip_view_release(flip_view *);
+void flip_view_rows(const flip_view *, int, int, pixel *);
+void flip_view_materialize(const flip_view *, pixel *);
+pixel *flip_view_pixels(flip_view *);
+int convolve_view(const flip_view *, pixel *);
+flip_transform flip_compose(flip_transform, flip_transform);
+flip_transform flip_compose_chain(const flip_transform *, int);
+void flip_chain(int, const flip_transform *, int, pixel *, pixel *);
+void flip_view_apply(flip_view *, flip_transform);
+ 
+void flip_rect_transform(flip_transform, int, int, pixel *, int, pixel *, int);
+void flip_rect(int, int, pixel *, int, pixel *, int);
+void convolve_rect(int, int, pixel *, int, pixel *, int);
+ 
+int format_pixel_bytes(pixel_format);
+const char *format_name(pixel_format);
+int format_image_alloc(format_image *, pixel_format, int);
+void format_image_free(format_image *);
+void format_from_pixels(int, const pixel *, format_image *);
+void format_to_pixels(int, const format_image *, pixel *);
+void format_flip(const format_image *, format_image *);
+int format_convolve(const format_image *, format_image *);
+ 
+int halo_alloc(halo_image *, int, halo_mode);
+void halo_free(halo_image *);
+void halo_update(halo_image *, int, int);
+void halo_fill(halo_image *);
+void halo_load_rows(halo_image *, const pixel *, int, int);
+int halo_convolve(const halo_image *, pixel *);
+ 
+int convolve_stream(int, int, row_source_func, void *, row_sink_func, void *);
+int convolve_stream_fd(int, int, int, int);
+int convolve_stream_mmap(int, int, int, int);
+ 
+#endif /* _KERNELS_H_ */